@@ -0,0 +1,499 @@
+/**
+  Byte sources and sinks, and the block reader for the data section of .dta files.
+
+  (c) 2026 the stataread contributors.
+
+  Blocks of whole records are handed out from a ring of buffers.
+  With threads, several I/O threads fill the ring with pread() from
+  the underlying descriptor, each at its own offset, so that a number
+  of large reads are in flight while the caller decodes; without them
+  each block is read with a single call to the source when it is
+  asked for.  Memory sources need no buffers at all.
+
+  In direct mode the descriptor is switched to O_DIRECT for the data
+  section, so reads go into aligned buffers and by-pass the page
+  cache.  Pages that do pass through the cache, where O_DIRECT is not
+  available, are dropped with posix_fadvise() as soon as they have
+  been read.
+
+  No R API calls are made here, so the I/O thread is safe.
+**/
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE   /* O_DIRECT */
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "stataio.h"
+
+#ifdef STATA_THREADS
+# include <pthread.h>
+# include <sys/types.h>
+# include <unistd.h>
+# include <fcntl.h>
+# include <sys/mman.h>
+#else
+# include <io.h>
+#endif
+
+/* offsets, lengths and buffers must be multiples of this for O_DIRECT */
+#define DIRECT_ALIGN 4096
+
+#define SLOT_EMPTY 0
+#define SLOT_READING 1
+#define SLOT_FULL 2
+
+struct blockreader {
+    dtasource *src;
+    int reclen;
+    int blockrecs;     /* records in a full block */
+    int nobs;
+    int fetched;       /* records read so far without threads */
+    int nblocks;
+    int nslots;
+    unsigned char *buf[BLOCKREADER_DEPTH];
+    int nrec[BLOCKREADER_DEPTH];
+    int skip[BLOCKREADER_DEPTH];   /* alignment bytes before the first record */
+    int state[BLOCKREADER_DEPTH];
+    int head;          /* next block to hand to the caller */
+    int claimed;       /* next block for an I/O thread to read */
+    int held;          /* caller still decoding block head */
+    const char *err;
+#ifdef STATA_THREADS
+    int nthreads;
+    int stop;
+    int direct;        /* O_DIRECT set on fd; oldflags to restore */
+    int oldflags;
+    int dontneed;
+    int fd;
+    off_t offset;      /* of the first record */
+    pthread_t thread[BLOCKREADER_IOTHREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+};
+
+static const char *readerr = "a binary read error occured";
+static const char *eoferr = "unexpected end of file in data section";
+
+
+/** Sources **/
+
+static size_t file_read(dtasource *src, void *buf, size_t n)
+{
+    return fread(buf, 1, n, src->fp);
+}
+
+void source_file(dtasource *src, FILE *fp)
+{
+    memset(src, 0, sizeof(dtasource));
+    src->read = file_read;
+    src->fp = fp;
+}
+
+static size_t memory_read(dtasource *src, void *buf, size_t n)
+{
+    if (n > src->len - src->pos)
+	n = src->len - src->pos;
+    memcpy(buf, src->mem + src->pos, n);
+    src->pos += n;
+    return n;
+}
+
+void source_memory(dtasource *src, const void *mem, size_t len)
+{
+    memset(src, 0, sizeof(dtasource));
+    src->read = memory_read;
+    src->mem = mem;
+    src->len = len;
+}
+
+
+/** Sinks **/
+
+static size_t file_write(datasink *sink, const void *buf, size_t n)
+{
+    return fwrite(buf, 1, n, sink->fp);
+}
+
+void sink_file(datasink *sink, FILE *fp)
+{
+    memset(sink, 0, sizeof(datasink));
+    sink->write = file_write;
+    sink->fp = fp;
+}
+
+static size_t memory_write(datasink *sink, const void *buf, size_t n)
+{
+    if (n > sink->len - sink->pos)
+	n = sink->len - sink->pos;
+    memcpy(sink->mem + sink->pos, buf, n);
+    sink->pos += n;
+    return n;
+}
+
+void sink_memory(datasink *sink, void *mem, size_t len)
+{
+    memset(sink, 0, sizeof(datasink));
+    sink->write = memory_write;
+    sink->mem = mem;
+    sink->len = len;
+}
+
+/* cuts fp back to size bytes, once what was written after is unwanted */
+
+int truncate_output(FILE *fp, off_t size)
+{
+    if (fflush(fp) != 0)
+	return 0;
+#ifdef STATA_THREADS
+    return ftruncate(fileno(fp), size) == 0;
+#else
+    return _chsize_s(_fileno(fp), size) == 0;
+#endif
+}
+
+#ifdef STATA_THREADS
+
+/* read len bytes at offset, of which the first need must be present */
+
+static const char *pread_full(int fd, unsigned char *buf, size_t len,
+			      size_t need, off_t offset)
+{
+    ssize_t got;
+    size_t done = 0;
+
+    while (done < need) {
+	got = pread(fd, buf + done, len - done, offset + done);
+	if (got < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return readerr;
+	}
+	if (got == 0)
+	    return eoferr;
+	done += got;
+    }
+    return NULL;
+}
+
+/* 0 if the write failed */
+
+int pwrite_full(int fd, const unsigned char *buf, size_t len, off_t offset)
+{
+    ssize_t put;
+
+    while (len > 0) {
+	put = pwrite(fd, buf, len, offset);
+	if (put < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return 0;
+	}
+	buf += put;
+	len -= put;
+	offset += put;
+    }
+    return 1;
+}
+
+/**
+   Sizes the empty file fp to size bytes, with the disk space
+   allocated, and maps it for writing, so records can be encoded
+   straight into the file.  fp must be open for reading too ("w+b").
+   NULL if that is not possible; fp may have been sized by then, but
+   the ordinary writer fills all size bytes from the start anyway.
+**/
+
+void *map_output(FILE *fp, size_t size)
+{
+#if defined(_POSIX_ADVISORY_INFO) && _POSIX_ADVISORY_INFO > 0
+    int fd = fileno(fp);
+    void *mem;
+
+    if (fd < 0 || size == 0 || fflush(fp) != 0 || ftello(fp) != 0)
+	return NULL;
+    /* a sparse mapping would fail with SIGBUS on a full disk */
+    if (posix_fallocate(fd, 0, size) != 0)
+	return NULL;
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED)
+	return NULL;
+    return mem;
+#else
+    return NULL;     /* no posix_fallocate() */
+#endif
+}
+
+/* the pages are written back by the system, as after write() */
+
+int unmap_output(void *mem, size_t size)
+{
+    return munmap(mem, size) == 0;
+}
+
+/* after a failed write: the file is left empty rather than full of zeros */
+
+int discard_output(void *mem, size_t size, FILE *fp)
+{
+    int ok = munmap(mem, size) == 0;
+
+    return ftruncate(fileno(fp), 0) == 0 && ok;
+}
+
+/* I/O threads claim blocks in order and read them into their slots */
+
+static void *prefetch_thread(void *arg)
+{
+    blockreader *br = arg;
+    int block, slot, n, skip;
+    off_t offset, start;
+    size_t len, need;
+    const char *err;
+
+    pthread_mutex_lock(&br->lock);
+    for(;;) {
+	while (!br->stop && !br->err && br->claimed < br->nblocks
+	       && br->state[br->claimed % br->nslots] != SLOT_EMPTY)
+	    pthread_cond_wait(&br->cond, &br->lock);
+	if (br->stop || br->err || br->claimed == br->nblocks)
+	    break;
+	block = br->claimed++;
+	slot = block % br->nslots;
+	br->state[slot] = SLOT_READING;
+	n = br->nobs - block * br->blockrecs;
+	if (n > br->blockrecs)
+	    n = br->blockrecs;
+	offset = br->offset + (off_t) block * br->blockrecs * br->reclen;
+	pthread_mutex_unlock(&br->lock);
+
+	need = (size_t) n * br->reclen;
+	start = offset;
+	len = need;
+	if (br->direct) {
+	    start = offset - offset % DIRECT_ALIGN;
+	    need += offset - start;
+	    len = (need + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+	}
+	skip = (int) (offset - start);
+	err = pread_full(br->fd, br->buf[slot], len, need, start);
+#ifdef POSIX_FADV_DONTNEED
+	if (!err && br->dontneed)
+	    posix_fadvise(br->fd, offset, (off_t) n * br->reclen,
+			  POSIX_FADV_DONTNEED);
+#endif
+
+	pthread_mutex_lock(&br->lock);
+	if (err) {
+	    br->err = err;
+	    pthread_cond_broadcast(&br->cond);
+	    break;
+	}
+	br->nrec[slot] = n;
+	br->skip[slot] = skip;
+	br->state[slot] = SLOT_FULL;
+	pthread_cond_broadcast(&br->cond);
+    }
+    pthread_mutex_unlock(&br->lock);
+    return NULL;
+}
+
+#endif
+
+
+/**
+   flags is BLOCKREADER_DIRECT or 0.  Direct mode is only a request:
+   it needs threads and falls back to buffered reads (with the pages
+   dropped from the cache) where the descriptor refuses O_DIRECT.
+**/
+
+blockreader *blockreader_open(dtasource *src, int reclen, int nobs, int flags)
+{
+    blockreader *br;
+    int i, nbuf, direct = 0;
+    size_t buflen;
+#ifdef STATA_THREADS
+    int nthreads;
+#endif
+
+    br = calloc(1, sizeof(blockreader));
+    if (!br)
+	return NULL;
+    br->src = src;
+    br->reclen = reclen > 0 ? reclen : 1;
+    br->nobs = nobs;
+    br->blockrecs = BLOCKREADER_BLOCKSIZE / br->reclen;
+    if (br->blockrecs < 1)
+	br->blockrecs = 1;
+    if (br->blockrecs > nobs)
+	br->blockrecs = nobs > 0 ? nobs : 1;
+
+    br->nblocks = nobs > 0 ? (nobs - 1) / br->blockrecs + 1 : 0;
+    if (src->mem)
+	return br;
+
+    /* a data section that fits in one block gains nothing from threads,
+       but direct reads have to go through the pread() path */
+    nbuf = 1;
+#ifdef STATA_THREADS
+    direct = (flags & BLOCKREADER_DIRECT) && br->nblocks > 0;
+    if ((br->nblocks > 1 || direct) && src->fp && fileno(src->fp) >= 0) {
+	br->fd = fileno(src->fp);
+	br->offset = ftello(src->fp);
+	if (br->offset >= 0)
+	    nbuf = br->nblocks < BLOCKREADER_DEPTH ? br->nblocks : BLOCKREADER_DEPTH;
+	else
+	    direct = 0;
+    } else
+	direct = 0;
+#endif
+    br->nslots = nbuf;
+    buflen = (size_t) br->blockrecs * br->reclen;
+    if (direct)
+	buflen += 2 * DIRECT_ALIGN;
+    for (i = 0; i < nbuf; i++) {
+#ifdef STATA_THREADS
+	if (direct) {
+	    if (posix_memalign((void **) &br->buf[i], DIRECT_ALIGN, buflen))
+		br->buf[i] = NULL;
+	} else
+#endif
+	    br->buf[i] = malloc(buflen);
+	if (!br->buf[i]) {
+	    blockreader_close(br);
+	    return NULL;
+	}
+    }
+#ifdef STATA_THREADS
+    if (direct) {
+#ifdef O_DIRECT
+	br->oldflags = fcntl(br->fd, F_GETFL);
+	if (br->oldflags != -1
+	    && fcntl(br->fd, F_SETFL, br->oldflags | O_DIRECT) == 0)
+	    br->direct = 1;
+#endif
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(br->fd, br->offset, (off_t) nobs * br->reclen,
+		      POSIX_FADV_SEQUENTIAL);
+	br->dontneed = !br->direct;
+#endif
+    }
+    if (nbuf > 1 || direct) {
+	nthreads = nbuf < BLOCKREADER_IOTHREADS ? nbuf : BLOCKREADER_IOTHREADS;
+	pthread_mutex_init(&br->lock, NULL);
+	pthread_cond_init(&br->cond, NULL);
+	for (i = 0; i < nthreads; i++)
+	    if (pthread_create(&br->thread[i], NULL, prefetch_thread, br) != 0)
+		break;
+	br->nthreads = i;
+	if (i == 0) {
+	    pthread_mutex_destroy(&br->lock);
+	    pthread_cond_destroy(&br->cond);
+	    if (br->direct)    /* stdio cannot read from it */
+		fcntl(br->fd, F_SETFL, br->oldflags);
+	    br->direct = 0;
+	}
+    }
+#endif
+    return br;
+}
+
+/**
+   Returns the next block and sets *nrec to the number of records in
+   it.  The block stays valid until the next call.  NULL means a read
+   error; see blockreader_error().
+**/
+
+const unsigned char *blockreader_next(blockreader *br, int *nrec)
+{
+    int n;
+    size_t len;
+    const unsigned char *block;
+#ifdef STATA_THREADS
+    int slot;
+#endif
+
+    *nrec = 0;
+#ifdef STATA_THREADS
+    if (br->nthreads) {
+	pthread_mutex_lock(&br->lock);
+	if (br->held) {
+	    br->state[br->head % br->nslots] = SLOT_EMPTY;
+	    br->head++;
+	    br->held = 0;
+	    pthread_cond_broadcast(&br->cond);
+	}
+	slot = br->head % br->nslots;
+	while (br->head < br->nblocks && br->state[slot] != SLOT_FULL
+	       && !br->err)
+	    pthread_cond_wait(&br->cond, &br->lock);
+	if (br->head == br->nblocks || br->state[slot] != SLOT_FULL) {
+	    if (!br->err)
+		br->err = eoferr;
+	    pthread_mutex_unlock(&br->lock);
+	    return NULL;
+	}
+	br->held = 1;
+	*nrec = br->nrec[slot];
+	pthread_mutex_unlock(&br->lock);
+	return br->buf[slot] + br->skip[slot];
+    }
+#endif
+    n = br->nobs - br->fetched;
+    if (n > br->blockrecs)
+	n = br->blockrecs;
+    if (n <= 0) {
+	br->err = eoferr;
+	return NULL;
+    }
+    len = (size_t) n * br->reclen;
+    if (br->src->mem) {
+	if (br->src->len - br->src->pos < len) {
+	    br->err = eoferr;
+	    return NULL;
+	}
+	block = br->src->mem + br->src->pos;
+	br->src->pos += len;
+    } else {
+	if (br->src->read(br->src, br->buf[0], len) != len) {
+	    br->err = (br->src->fp && ferror(br->src->fp)) ? readerr : eoferr;
+	    return NULL;
+	}
+	block = br->buf[0];
+    }
+    br->fetched += n;
+    *nrec = n;
+    return block;
+}
+
+const char *blockreader_error(blockreader *br)
+{
+    return br->err ? br->err : readerr;
+}
+
+void blockreader_close(blockreader *br)
+{
+    int i;
+
+    if (!br)
+	return;
+#ifdef STATA_THREADS
+    if (br->nthreads) {
+	pthread_mutex_lock(&br->lock);
+	br->stop = 1;
+	pthread_cond_broadcast(&br->cond);
+	pthread_mutex_unlock(&br->lock);
+	for (i = 0; i < br->nthreads; i++)
+	    pthread_join(br->thread[i], NULL);
+	pthread_mutex_destroy(&br->lock);
+	pthread_cond_destroy(&br->cond);
+    }
+    if (br->direct)
+	fcntl(br->fd, F_SETFL, br->oldflags);
+#endif
+    for (i = 0; i < BLOCKREADER_DEPTH; i++)
+	free(br->buf[i]);
+    free(br);
+}
@@ -0,0 +1,110 @@
+/**
+  Byte sources and sinks, and block I/O for the data section of .dta files.
+
+  (c) 2026 the stataread contributors.
+
+  The data section is a sequence of fixed-width records, so it is
+  read in blocks of whole records rather than one value at a time.
+  Where threads are available, background threads keep several
+  blocks in flight while the caller decodes the current one.
+**/
+
+#ifndef STATAIO_H
+#define STATAIO_H
+
+#include <stdio.h>
+
+#if !defined(_WIN32)
+# define STATA_THREADS 1
+# include <sys/types.h>
+#endif
+
+/* size of one read, rounded down to a whole number of records */
+#define BLOCKREADER_BLOCKSIZE (4*1024*1024)
+/* blocks buffered ahead of the decoder, and threads reading them */
+#define BLOCKREADER_DEPTH 8
+#define BLOCKREADER_IOTHREADS 4
+
+/**
+   A source of bytes for the reader: a file, a block of memory, or
+   anything else that can fill a buffer through read(), which
+   returns the number of bytes it could supply.  The block reader
+   uses fp, when it is set, to pread() the data section from other
+   threads, and hands out records from mem directly without copying.
+**/
+
+typedef struct dtasource dtasource;
+
+struct dtasource {
+    size_t (*read)(dtasource *src, void *buf, size_t n);
+    FILE *fp;
+    const unsigned char *mem;
+    size_t len, pos;     /* of mem */
+    void *data;          /* for other kinds of source */
+};
+
+void source_file(dtasource *src, FILE *fp);
+void source_memory(dtasource *src, const void *mem, size_t len);
+
+/**
+   Where the writer's bytes go: a file, a block of memory of the exact
+   size, or anything else that can take a buffer through write(),
+   which returns the number of bytes it took.  Records can be written
+   at offsets in fp, when it is set, from other threads, and encoded
+   straight into mem.
+**/
+
+typedef struct datasink datasink;
+
+struct datasink {
+    size_t (*write)(datasink *sink, const void *buf, size_t n);
+    FILE *fp;
+    unsigned char *mem;
+    size_t len, pos;     /* of mem */
+    void *data;          /* for other kinds of sink */
+};
+
+void sink_file(datasink *sink, FILE *fp);
+void sink_memory(datasink *sink, void *mem, size_t len);
+
+/* blockreader_open() flags */
+#define BLOCKREADER_DIRECT 1
+
+typedef struct blockreader blockreader;
+
+blockreader *blockreader_open(dtasource *src, int reclen, int nobs, int flags);
+const unsigned char *blockreader_next(blockreader *br, int *nrec);
+const char *blockreader_error(blockreader *br);
+void blockreader_close(blockreader *br);
+
+int truncate_output(FILE *fp, off_t size);
+#ifdef STATA_THREADS
+int pwrite_full(int fd, const unsigned char *buf, size_t len, off_t offset);
+void *map_output(FILE *fp, size_t size);
+int unmap_output(void *mem, size_t size);
+int discard_output(void *mem, size_t size, FILE *fp);
+#endif
+
+/* worker threads: statapar.c */
+typedef void (*paralleltask)(void *arg, int task, int thread);
+
+int parallel_for(int nthreads, int ntasks, paralleltask fn, void *arg);
+
+/* compressed files: statazip.c */
+#define ZIP_NONE 0
+#define ZIP_GZIP 1
+#define ZIP_ZSTD 2
+
+typedef struct unzipper unzipper;
+typedef struct zipper zipper;
+
+int zip_detect(FILE *fp);
+int zip_suffix(const char *name);
+unzipper *unzip_open(FILE *fp, int type, const char **err);
+FILE *unzip_file(unzipper *uz);
+const char *unzip_close(unzipper *uz);
+zipper *zip_open(FILE *fp, int type, int threads, const char **err);
+FILE *zip_file(zipper *zp);
+const char *zip_close(zipper *zp);
+
+#endif
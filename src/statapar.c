@@ -0,0 +1,93 @@
+/**
+  Worker threads.
+
+  (c) 2026 the stataread contributors.
+
+  parallel_for() runs ntasks calls of a task function on up to
+  nthreads threads, each taking the next task number as it becomes
+  free, and returns when all of them are done.  The calling thread is
+  one of the workers.  Task functions must not call the R API.
+**/
+
+#include <stdlib.h>
+#include "stataio.h"
+
+#ifdef STATA_THREADS
+# include <pthread.h>
+
+typedef struct {
+    paralleltask fn;
+    void *arg;
+    int ntasks;
+    int next;
+    pthread_mutex_t lock;
+} taskqueue;
+
+typedef struct {
+    taskqueue *q;
+    int thread;
+} worker;
+
+static void *work(void *data)
+{
+    worker *w = data;
+    taskqueue *q = w->q;
+    int task;
+
+    for(;;) {
+	pthread_mutex_lock(&q->lock);
+	task = q->next++;
+	pthread_mutex_unlock(&q->lock);
+	if (task >= q->ntasks)
+	    break;
+	q->fn(q->arg, task, w->thread);
+    }
+    return NULL;
+}
+
+#endif
+
+int parallel_for(int nthreads, int ntasks, paralleltask fn, void *arg)
+{
+    int i;
+#ifdef STATA_THREADS
+    taskqueue q;
+    worker *w;
+    pthread_t *th;
+    int started;
+
+    if (nthreads > ntasks)
+	nthreads = ntasks;
+    if (nthreads > 1) {
+	w = malloc(nthreads * sizeof(worker));
+	th = malloc(nthreads * sizeof(pthread_t));
+	if (w && th) {
+	    q.fn = fn;
+	    q.arg = arg;
+	    q.ntasks = ntasks;
+	    q.next = 0;
+	    pthread_mutex_init(&q.lock, NULL);
+	    for (i = 0; i < nthreads; i++) {
+		w[i].q = &q;
+		w[i].thread = i;
+	    }
+	    /* worker 0 is this thread */
+	    for (started = 1; started < nthreads; started++)
+		if (pthread_create(&th[started], NULL, work, &w[started]) != 0)
+		    break;
+	    work(&w[0]);
+	    for (i = 1; i < started; i++)
+		pthread_join(th[i], NULL);
+	    pthread_mutex_destroy(&q.lock);
+	    free(w);
+	    free(th);
+	    return started;
+	}
+	free(w);
+	free(th);
+    }
+#endif
+    for (i = 0; i < ntasks; i++)
+	fn(arg, i, 0);
+    return 1;
+}
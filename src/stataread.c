@@ -20,6 +20,10 @@
 #include "R.h"
 #include "Rinternals.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "stataio.h"
 
 /** R 1.2 compatibility definitions **/
 #if R_VERSION < R_Version(1, 2, 0)
@@ -29,6 +33,11 @@
 # define SET_VECTOR_ELT(x,i,v)  (VECTOR(x)[i]=(v))
 #endif
 
+/** ALTREP vectors (R 3.5.0) can be read a region at a time **/
+#if R_VERSION >= R_Version(3, 5, 0)
+# define HAVE_ALTREP 1
+#endif
+
 /* handling endianess*/
 #define LOHI 1
 #define HILO 2
@@ -132,30 +141,30 @@ static void setup_consts()
 
 /** Low-level input **/
 
-static int InIntegerBinary(FILE * fp, int naok, int swapends)
+static int InIntegerBinary(dtasource *src, int naok, int swapends)
 {
     int i;
-    if (fread(&i, sizeof(int), 1, fp) != 1)
+    if (src->read(src, &i, sizeof(int)) != sizeof(int))
 	error("a binary read error occured");
     if (swapends)
 	i=swapi(i);
     return ((i==STATA_INT_NA) & !naok ? NA_INTEGER : i);
 }
 
-static int InByteBinary(FILE * fp, int naok)
+static int InByteBinary(dtasource *src, int naok)
 { 
     unsigned char i;
-    if (fread(&i, sizeof(char), 1, fp) != 1)
+    if (src->read(src, &i, sizeof(char)) != sizeof(char))
 	error("a binary read error occured");
     return  ((i==STATA_BYTE_NA) & !naok ? NA_INTEGER : (int) i);
 }
 
-static int InShortIntBinary(FILE * fp, int naok,int swapends)
+static int InShortIntBinary(dtasource *src, int naok,int swapends)
 {
   unsigned short first,second,result;
   
-  first = InByteBinary(fp,1);
-  second = InByteBinary(fp,1);
+  first = InByteBinary(src,1);
+  second = InByteBinary(src,1);
   if (stata_endian==LOHI){
     result= (first<<8) | second;
   } else {
@@ -165,156 +174,326 @@ static int InShortIntBinary(FILE * fp, int naok,int swapends)
 }
 
 
-static double InDoubleBinary(FILE * fp, int naok, int swapends)
+static void InStringBinary(dtasource *src, int nchar, char* buffer)
 {
-    double i;
-    if (fread(&i, sizeof(double), 1, fp) != 1)
+    if (src->read(src, buffer, nchar) != (size_t) nchar)
 	error("a binary read error occured");
-    if (swapends)
-	i=swapd(i);
-    return ((i==STATA_DOUBLE_NA) & !naok ? NA_REAL : i);
 }
 
-static float InFloatBinary(FILE * fp, int naok, int swapends)
+static char* nameMangle(char *stataname, int len){
+    int i;
+    for(i=0;i<len;i++)
+      if (stataname[i]=='_') stataname[i]='.';
+    return stataname;
+}
+
+
+/** Decoding whole records from the block reader **/
+
+static int StataTypeWidth(int type)
 {
-    float i;
-    if (fread(&i, sizeof(float), 1, fp) != 1)
-	error("a binary read error occured");
-    if (swapends)
-	i= swapf(i);
-    return ((i==STATA_FLOAT_NA) & !naok ? (float) NA_REAL :  i);
+    switch (type) {
+    case STATA_FLOAT:
+    case STATA_INT:
+        return 4;
+    case STATA_DOUBLE:
+        return 8;
+    case STATA_SHORTINT:
+        return 2;
+    case STATA_BYTE:
+        return 1;
+    default:
+        return type-STATA_STRINGOFFSET;
+    }
 }
 
-static void InStringBinary(FILE * fp, int nchar, char* buffer)
+typedef struct {
+    SEXP df;
+    int *types;
+    int *offsets;    /* of each variable in a record; offsets[nvar] is the record length */
+    int nvar, nobs, swapends;
+    blockreader *br;
+} datasection;
+
+/**
+   Decodes nrec numbers of Stata type type, reclen bytes apart from p,
+   in a file of byte order fileendian, into ints or, if that is NULL,
+   reals; floats and doubles always go to reals.  No R API here:
+   several files are decoded at once by worker threads.
+**/
+
+static void DecodeNumbers(const unsigned char *p, int reclen, int nrec,
+                          int type, int fileendian, int *ints, double *reals)
 {
-    if (fread(buffer, nchar, 1, fp) != 1)
-	error("a binary read error occured");
+    int r, ival, swapends=(fileendian!=endian);
+    unsigned short sval;
+    double dval;
+    float fval;
+
+    switch (type) {
+    case STATA_FLOAT:
+        for(r=0;r<nrec;r++,p+=reclen){
+            memcpy(&fval,p,4);
+            if (swapends)
+                fval=swapf(fval);
+            reals[r]=(fval==STATA_FLOAT_NA ? NA_REAL : fval);
+        }
+        return;
+    case STATA_DOUBLE:
+        for(r=0;r<nrec;r++,p+=reclen){
+            memcpy(&dval,p,8);
+            if (swapends)
+                dval=swapd(dval);
+            reals[r]=(dval==STATA_DOUBLE_NA ? NA_REAL : dval);
+        }
+        return;
+    }
+    for(r=0;r<nrec;r++,p+=reclen){
+        switch (type) {
+        case STATA_INT:
+            memcpy(&ival,p,4);
+            if (swapends)
+                ival=swapi(ival);
+            ival=(ival==STATA_INT_NA ? NA_INTEGER : ival);
+            break;
+        case STATA_SHORTINT:
+            if (fileendian==LOHI)
+                sval=(p[0]<<8) | p[1];
+            else
+                sval=(p[1]<<8) | p[0];
+            ival=(sval==STATA_SHORTINT_NA ? NA_INTEGER : (short) sval);
+            break;
+        default:
+            /* byte and int are signed */
+            ival=(p[0]==STATA_BYTE_NA ? NA_INTEGER : (signed char) p[0]);
+            break;
+        }
+        if (ints)
+            ints[r]=ival;
+        else
+            reals[r]=(ival==NA_INTEGER ? NA_REAL : ival);
+    }
 }
 
-static char* nameMangle(char *stataname, int len){
-    int i;
-    for(i=0;i<len;i++)
-      if (stataname[i]=='_') stataname[i]='.';
-    return stataname;
+/* decode nrec records of variable j into rows first.. of its column */
+
+static void DecodeColumn(datasection *d, int j, const unsigned char *block,
+                         int first, int nrec)
+{
+    int r, reclen=d->offsets[d->nvar], charlen;
+    const unsigned char *p=block+d->offsets[j];
+    SEXP col=VECTOR_ELT(d->df,j);
+    char sbuf[256];
+
+    switch (d->types[j]) {
+    case STATA_FLOAT:
+    case STATA_DOUBLE:
+        DecodeNumbers(p,reclen,nrec,d->types[j],stata_endian,NULL,REAL(col)+first);
+        break;
+    case STATA_INT:
+    case STATA_SHORTINT:
+    case STATA_BYTE:
+        DecodeNumbers(p,reclen,nrec,d->types[j],stata_endian,INTEGER(col)+first,NULL);
+        break;
+    default:
+        charlen=d->types[j]-STATA_STRINGOFFSET;
+        for(r=0;r<nrec;r++,p+=reclen){
+            memcpy(sbuf,p,charlen);
+            sbuf[charlen]=0;
+            SET_STRING_ELT(col,first+r,mkChar(sbuf));
+        }
+        break;
+    }
 }
 
+static SEXP DecodeData(void *data)
+{
+    datasection *d=data;
+    const unsigned char *block;
+    int i,j,nrec;
 
-/*****
-      Turn a .dta file into a data frame
-      Variable labels go to attributes of the data frame
+    for(i=0;i<d->nobs;i+=nrec){
+        block=blockreader_next(d->br,&nrec);
+        if (!block)
+            error("%s", blockreader_error(d->br));
+        for(j=0;j<d->nvar;j++)
+            DecodeColumn(d,j,block,i,nrec);
+    }
+    return R_NilValue;
+}
 
-      value labels and characteristics could go as attributes of the variables 
-      not yet implemented
-****/
+static void CloseData(void *data)
+{
+    blockreader_close(((datasection *) data)->br);
+}
 
 
+/** The header and variable descriptors, up to the data section **/
 
-SEXP R_LoadStataData(FILE *fp)
+typedef struct {
+    int version5, swapends;
+    int nvar, nobs;
+    char datalabel[81], timestamp[18];
+    int *types;
+    char (*names)[9];
+    int *sortlist;        /* variable numbers from 1, ended by 0 */
+    char (*formats)[12];
+    char (*lblnames)[9];  /* value label of each variable */
+    char (*varlabels)[81];
+    int *offsets;    /* of each variable in a record; offsets[nvar] is the record length */
+} dtaheader;
+
+static void ReadHeader(dtasource *src, dtaheader *h)
 {
-    int i,j,nvar,nobs,charlen, version5,swapends;
+    int i,charlen,lablen;
     unsigned char abyte;
-    char datalabel[81], timestamp[18], aname[9];
-    SEXP df,names,tmp,varlabels,types,row_names;
-   
-    
+
     setup_consts();  /*endianness*/
 
     /** first read the header **/
     
-    abyte=InByteBinary(fp,1);   /* release version */
-    version5=0;  /*-Wall*/
+    abyte=InByteBinary(src,1);   /* release version */
+    h->version5=0;  /*-Wall*/
     switch (abyte){
     case 0x69:
-        version5=1;
+        h->version5=1;
 	break;
     case 'l':
-        version5=0;
+        h->version5=0;
 	break;
     default:
         error("Not a Stata v5 or v6 file");
     }
-    stata_endian=(int) InByteBinary(fp,1);     /* byte ordering */
+    stata_endian=(int) InByteBinary(src,1);     /* byte ordering */
     if (endian!=stata_endian)
-	swapends=1;
+	h->swapends=1;
     else 
-	swapends=0;
+	h->swapends=0;
 
-    InByteBinary(fp,1);            /* filetype -- junk */
-    InByteBinary(fp,1);            /* padding */
-    nvar =  (InShortIntBinary(fp,1,swapends)); /* number of variables */
-    nobs =(InIntegerBinary(fp,1,swapends));  /* number of cases */
+    InByteBinary(src,1);            /* filetype -- junk */
+    InByteBinary(src,1);            /* padding */
+    h->nvar =  (InShortIntBinary(src,1,h->swapends)); /* number of variables */
+    h->nobs =(InIntegerBinary(src,1,h->swapends));  /* number of cases */
     /* data label - zero terminated string */
-    if (version5)         
-        InStringBinary(fp,32,datalabel);
-    else
-        InStringBinary(fp,81,datalabel);   
+    lablen=(h->version5 ? 32 : 81);
+    /* v5 labels are shorter: the rest of each 81 bytes is left zero */
+    memset(h->datalabel,0,81);
+    InStringBinary(src,lablen,h->datalabel);
     /* file creation time - zero terminated string */
-    InStringBinary(fp,18,timestamp);  
-  
-    /** make the data frame **/
-
-    PROTECT(df=allocVector(VECSXP, nvar));
-   
-    /** and now stick the labels on it **/
-    
-    PROTECT(tmp=allocVector(STRSXP,1));
-    /* STRING(tmp)[0]=mkChar(datalabel);*/
-    SET_STRING_ELT(tmp,0,mkChar(datalabel));
-    setAttrib(df,install("datalabel"),tmp);
-    UNPROTECT(1);
-    PROTECT(tmp=allocVector(STRSXP,1));
-    /* STRING(tmp)[0]=mkChar(timestamp);*/
-    SET_STRING_ELT(tmp,0,mkChar(timestamp));
-    setAttrib(df,install("time.stamp"),tmp);
-    UNPROTECT(1);
+    InStringBinary(src,18,h->timestamp);  
 
-      
     /** read variable descriptors **/
     
     /** types **/
     
-    PROTECT(types=allocVector(INTSXP,nvar));
-    for(i=0;i<nvar;i++){
-        abyte = InByteBinary(fp,1);
-	INTEGER(types)[i]= abyte;
+    h->types=(int *) R_alloc(h->nvar+1, sizeof(int));
+    for(i=0;i<h->nvar;i++){
+        abyte = InByteBinary(src,1);
+	h->types[i]= abyte;
         switch (abyte) {
 	case STATA_FLOAT:
 	case STATA_DOUBLE:
-	    /* VECTOR(df)[i]=allocVector(REALSXP,nobs);*/
-	    SET_VECTOR_ELT(df,i,allocVector(REALSXP,nobs));
-	    break;
 	case STATA_INT:
 	case STATA_SHORTINT:
 	case STATA_BYTE:
-	    /* VECTOR(df)[i]=allocVector(INTSXP,nobs);*/
-	    SET_VECTOR_ELT(df,i,allocVector(INTSXP,nobs));
 	    break;
 	default:
 	    if (abyte<STATA_STRINGOFFSET)
 	      error("Unknown data type");
-	    /* VECTOR(df)[i]=allocVector(STRSXP,nobs);*/
-	    SET_VECTOR_ELT(df,i,allocVector(STRSXP,nobs));
 	    break;
 	}
     }
 
     /** names **/
 
+    h->names=(char (*)[9]) R_alloc(h->nvar+1, 9);
+    for (i=0;i<h->nvar;i++)
+        InStringBinary(src,9,h->names[i]);
+
+    /** sortlist **/
+
+    h->sortlist=(int *) R_alloc(h->nvar+1, sizeof(int));
+    for (i=0;i<h->nvar+1;i++)
+        h->sortlist[i]=InShortIntBinary(src,1,h->swapends);
+    
+    /** format list **/
+
+    h->formats=(char (*)[12]) R_alloc(h->nvar+1, 12);
+    for (i=0;i<h->nvar;i++)
+        InStringBinary(src,12,h->formats[i]);
+
+    /** value labels.  These are stored as the names of label formats, 
+	which are themselves stored later in the file. **/
+ 
+    h->lblnames=(char (*)[9]) R_alloc(h->nvar+1, 9);
+    for(i=0;i<h->nvar;i++)
+        InStringBinary(src,9,h->lblnames[i]);
+
+    /** Variable Labels **/
+    
+    h->varlabels=(char (*)[81]) R_alloc(h->nvar+1, 81);
+    memset(h->varlabels,0,(size_t) (h->nvar+1)*81);
+    for(i=0;i<h->nvar;i++)
+        InStringBinary(src,lablen,h->varlabels[i]);
+
+    /** variable 'characteristics'  -- not yet implemented **/
+
+    while(InByteBinary(src,1)) {
+        charlen= (InShortIntBinary(src,1,h->swapends));
+	for (i=0;i<charlen;i++)
+	  InByteBinary(src,1);
+    }
+    charlen=(InShortIntBinary(src,1,h->swapends));
+    if (charlen!=0)
+      error("Something strange in the file\n (Type 0 characteristic of nonzero length)");
+
+    h->offsets=(int *) R_alloc(h->nvar+1, sizeof(int));
+    h->offsets[0]=0;
+    for(i=0;i<h->nvar;i++)
+        h->offsets[i+1]=h->offsets[i]+StataTypeWidth(h->types[i]);
+}
+
+
+/*****
+      Turn a .dta file into a data frame
+      Variable labels go to attributes of the data frame
+
+      value labels and characteristics could go as attributes of the variables 
+      not yet implemented
+****/
+
+
+
+/* the labels, names and row names, from the header of the (first) file */
+
+static void LabelFrame(SEXP df, dtaheader *h, int nobs)
+{
+    int i,nvar=h->nvar;
+    char datalabel[81];
+    SEXP names,tmp,varlabels,row_names;
+
+    PROTECT(tmp=allocVector(STRSXP,1));
+    /* STRING(tmp)[0]=mkChar(datalabel);*/
+    SET_STRING_ELT(tmp,0,mkChar(h->datalabel));
+    setAttrib(df,install("datalabel"),tmp);
+    UNPROTECT(1);
+    PROTECT(tmp=allocVector(STRSXP,1));
+    /* STRING(tmp)[0]=mkChar(timestamp);*/
+    SET_STRING_ELT(tmp,0,mkChar(h->timestamp));
+    setAttrib(df,install("time.stamp"),tmp);
+    UNPROTECT(1);
+
+    /** names **/
+
     PROTECT(names=allocVector(STRSXP,nvar));
     for (i=0;i<nvar;i++){
-        InStringBinary(fp,9,aname);
         /* STRING(names)[i]=mkChar(nameMangle(aname,9));*/
-	SET_STRING_ELT(names,i,mkChar(nameMangle(aname,9)));
+	SET_STRING_ELT(names,i,mkChar(nameMangle(h->names[i],9)));
     }
     setAttrib(df,R_NamesSymbol, names);
     
     UNPROTECT(1);
 
-    /** sortlist -- not relevant **/
-
-    for (i=0;i<2*(nvar+1);i++)
-        InByteBinary(fp,1);
-    
     /** format list
 	passed back to R as attributes.
 	Useful to identify date variables.
@@ -322,87 +501,23 @@ SEXP R_LoadStataData(FILE *fp)
 
     PROTECT(tmp=allocVector(STRSXP,nvar));
     for (i=0;i<nvar;i++){
-        InStringBinary(fp,12,timestamp);
 	/* STRING(tmp)[i]=mkChar(timestamp);*/
-	SET_STRING_ELT(tmp,i,mkChar(timestamp));
+	SET_STRING_ELT(tmp,i,mkChar(h->formats[i]));
     }
     setAttrib(df,install("formats"),tmp);
     UNPROTECT(1);
 
-    /** value labels.  These are stored as the names of label formats, 
-	which are themselves stored later in the file.  Not implemented**/
- 
-    for(i=0;i<nvar;i++){
-        InStringBinary(fp,9,aname);
-    }
-	
-
     /** Variable Labels **/
     
     PROTECT(varlabels=allocVector(STRSXP,nvar));
-
-    if (version5){
-        for(i=0;i<nvar;i++) {
-            InStringBinary(fp,32,datalabel);
-	    /* STRING(varlabels)[i]=mkChar(datalabel);*/
-	    SET_STRING_ELT(varlabels,i,mkChar(datalabel));
-	}
-    } else {
-        for(i=0;i<nvar;i++) {
-            InStringBinary(fp,81,datalabel);
-	    /* STRING(varlabels)[i]=mkChar(datalabel);*/
-	    SET_STRING_ELT(varlabels,i,mkChar(datalabel));
-	}
+    for(i=0;i<nvar;i++) {
+        /* STRING(varlabels)[i]=mkChar(datalabel);*/
+        SET_STRING_ELT(varlabels,i,mkChar(h->varlabels[i]));
     }
     setAttrib(df, install("var.labels"), varlabels);
     
     UNPROTECT(1);
 
-    /** variable 'characteristics'  -- not yet implemented **/
-
-    while(InByteBinary(fp,1)) {
-        charlen= (InShortIntBinary(fp,1,swapends));
-	for (i=0;i<charlen;i++)
-	  InByteBinary(fp,1);
-    }
-    charlen=(InShortIntBinary(fp,1,swapends));
-    if (charlen!=0)
-      error("Something strange in the file\n (Type 0 characteristic of nonzero length)");
-
-
-    /** The Data **/
-
-
-    for(i=0;i<nobs;i++){
-        for(j=0;j<nvar;j++){
-	    switch (INTEGER(types)[j]) {
-	    case STATA_FLOAT:
-		/* REAL(VECTOR(df)[j])[i]=(InFloatBinary(fp,0,swapends));*/
-		REAL(VECTOR_ELT(df,j))[i]=(InFloatBinary(fp,0,swapends));
-		break;
-	    case STATA_DOUBLE:
-	        REAL(VECTOR_ELT(df,j))[i]=(InDoubleBinary(fp,0,swapends));
-		break;
-	    case STATA_INT:
-	        INTEGER(VECTOR_ELT(df,j))[i]=(InIntegerBinary(fp,0,swapends));
-		break;
-	    case STATA_SHORTINT:
-	        INTEGER(VECTOR_ELT(df,j))[i]=(InShortIntBinary(fp,0,swapends));
-		break;
-	    case STATA_BYTE:
-	        INTEGER(VECTOR_ELT(df,j))[i]=(int) InByteBinary(fp,0);
-		break;
-	    default:
-	        charlen=INTEGER(types)[j]-STATA_STRINGOFFSET;
-	        PROTECT(tmp=allocString(charlen+1));
-		InStringBinary(fp,charlen,CHAR(tmp));
-		CHAR(tmp)[charlen]=0;
-		SET_STRING_ELT(VECTOR_ELT(df,j),i,tmp);
-		UNPROTECT(1);
-	      break;
-	    }
-	}
-    }  
     PROTECT(tmp = mkString("data.frame"));
     setAttrib(df, R_ClassSymbol, tmp);
     UNPROTECT(1);
@@ -414,265 +529,4149 @@ SEXP R_LoadStataData(FILE *fp)
     }
     setAttrib(df, R_RowNamesSymbol, row_names);
     UNPROTECT(1);     
+}
+
+SEXP R_LoadStataData(dtasource *src, int direct)
+{
+    int i,nvar,nobs;
+    dtaheader h;
+    datasection data;
+    SEXP df;
+   
+    
+    ReadHeader(src,&h);
+    nvar=h.nvar;
+    nobs=h.nobs;
+  
+    /** make the data frame **/
+
+    PROTECT(df=allocVector(VECSXP, nvar));
+      
+    /** columns **/
+    
+    for(i=0;i<nvar;i++){
+        switch (h.types[i]) {
+	case STATA_FLOAT:
+	case STATA_DOUBLE:
+	    /* VECTOR(df)[i]=allocVector(REALSXP,nobs);*/
+	    SET_VECTOR_ELT(df,i,allocVector(REALSXP,nobs));
+	    break;
+	case STATA_INT:
+	case STATA_SHORTINT:
+	case STATA_BYTE:
+	    /* VECTOR(df)[i]=allocVector(INTSXP,nobs);*/
+	    SET_VECTOR_ELT(df,i,allocVector(INTSXP,nobs));
+	    break;
+	default:
+	    /* VECTOR(df)[i]=allocVector(STRSXP,nobs);*/
+	    SET_VECTOR_ELT(df,i,allocVector(STRSXP,nobs));
+	    break;
+	}
+    }
+
+    /** The Data **/
+
+    data.df=df;
+    data.types=h.types;
+    data.nvar=nvar;
+    data.nobs=nobs;
+    data.swapends=h.swapends;
+    data.offsets=h.offsets;
+    data.br=blockreader_open(src,data.offsets[nvar],nobs,
+                            direct ? BLOCKREADER_DIRECT : 0);
+    if (!data.br)
+        error("cannot allocate buffer for data");
+    R_ExecWithCleanup(DecodeData, &data, CloseData, &data);
 
-    UNPROTECT(2); /* types, df */
+    LabelFrame(df,&h,nobs);
+
+    UNPROTECT(1); /* df */
 
     return(df);
 
 }
+/** Connections are read through a buffer, and written, on the main thread **/
+
+#if R_VERSION >= R_Version(3, 3, 0)
+# define HAVE_CONNECTIONS 1
+# include <R_ext/Connections.h>
+# if R_CONNECTIONS_VERSION != 1
+#  error "unsupported connections API version"
+# endif
+
+#define CONNBUFSIZE 65536
+
+typedef struct {
+    Rconnection con;
+    unsigned char buf[CONNBUFSIZE];
+    size_t pos, len;
+} connbuffer;
+
+static size_t ConnRead(dtasource *src, void *buf, size_t n)
+{
+    connbuffer *cb=src->data;
+    size_t got=0, m;
+
+    while (got<n) {
+        if (cb->pos==cb->len) {
+            /* large reads by-pass the buffer */
+            if (n-got>=CONNBUFSIZE)
+                return got+R_ReadConnection(cb->con,(char *) buf+got,n-got);
+            cb->pos=0;
+            cb->len=R_ReadConnection(cb->con,cb->buf,CONNBUFSIZE);
+            if (cb->len==0)
+                break;
+        }
+        m=cb->len-cb->pos;
+        if (m>n-got)
+            m=n-got;
+        memcpy((char *) buf+got,cb->buf+cb->pos,m);
+        cb->pos+=m;
+        got+=m;
+    }
+    return got;
+}
+
+/* the writer's staging buffer already makes the writes large */
+
+static size_t ConnWrite(datasink *sink, const void *buf, size_t n)
+{
+    return R_WriteConnection((Rconnection) sink->data, (void *) buf, n);
+}
+#endif
+
+typedef struct {
+    FILE *fp;
+    unzipper *uz;
+    dtasource src;
+    int direct;
+} readinput;
+
+static SEXP LoadInput(void *data)
+{
+    readinput *in=data;
+
+    if (in->uz)
+        source_file(&in->src, unzip_file(in->uz));
+    return R_LoadStataData(&in->src, in->direct);
+}
+
+static void CloseInput(void *data)
+{
+    readinput *in=data;
+
+    if (in->uz)
+        unzip_close(in->uz);
+    if (in->fp)
+        fclose(in->fp);
+    free(in->src.data);   /* connection buffer */
+}
+
+/**
+   The first argument is a file name, a raw vector holding the
+   contents of a file, or an open binary-mode connection.
+**/
+
 SEXP do_readStata(SEXP call)
 { 
     SEXP fname,  result;
     FILE *fp;
+    int direct, zip;
+    readinput in;
+    const char *err;
 
     if ((sizeof(double)!=8) | (sizeof(int)!=4) | (sizeof(float)!=4))
       error("can't yet read Stata .dta on this platform");
 
+    fname = CADR(call);
+    direct=asLogical(CADDR(call));
+    if (direct==NA_LOGICAL)
+	error("'direct' must be TRUE or FALSE");
 
-    if (!isValidString(fname = CADR(call)))
-	error("first argument must be a file name\n");
+    memset(&in, 0, sizeof(readinput));
+    in.direct=direct;
+    if (TYPEOF(fname)==RAWSXP) {
+        source_memory(&in.src, RAW(fname), XLENGTH(fname));
+    } else if (inherits(fname,"connection")) {
+#ifdef HAVE_CONNECTIONS
+        connbuffer *cb=calloc(1,sizeof(connbuffer));
 
-    fp = fopen(R_ExpandFileName(CHAR(STRING_ELT(fname,0))), "rb");
-    if (!fp)
-	error("unable to open file");
-    result = R_LoadStataData(fp);
-    fclose(fp);
+        if (!cb)
+            error("cannot allocate buffer for connection");
+        cb->con=R_GetConnection(fname);
+        memset(&in.src, 0, sizeof(dtasource));
+        in.src.read=ConnRead;
+        in.src.data=cb;
+#else
+        error("reading from connections needs R 3.3.0 or later");
+#endif
+    } else {
+        if (!isValidString(fname))
+            error("first argument must be a file name, raw vector or connection\n");
+
+        fp = fopen(R_ExpandFileName(CHAR(STRING_ELT(fname,0))), "rb");
+        if (!fp)
+            error("unable to open file");
+        in.fp=fp;
+        source_file(&in.src, fp);
+        /* compressed files are decompressed on the fly by another thread */
+        zip=zip_detect(fp);
+        if (zip!=ZIP_NONE){
+            in.uz=unzip_open(fp,zip,&err);
+            if (!in.uz){
+                fclose(fp);
+                error("%s", err);
+            }
+        }
+    }
+    result = R_ExecWithCleanup(LoadInput, &in, CloseInput, &in);
     return result;
 }
 
 
-/** low level output **/
+/** Several files with the same variables, row-bound into one data
+    frame.  The headers are read, and checked against the first, on
+    this thread, since they are read into R's memory; the columns are
+    then made for all the cases, and each file's data section is
+    decoded straight into its rows by a worker thread.  A file is only
+    open while its header is read and while it is decoded, so no more
+    are open at once than there are threads. **/
+
+typedef struct {
+    readinput in;
+    const char *name, *path;
+    dtaheader h;
+    int endian;           /* byte order of the file */
+    size_t start;         /* of the data, in the uncompressed file */
+    int first;            /* row of its first case */
+    char **strings;       /* the bytes of each string variable */
+    const char *err;
+} readfile;
 
-static void OutIntegerBinary(int i, FILE * fp, int naok)
+typedef struct {
+    SEXP files;
+    readfile *rf;
+    int nfiles, nvar, direct, threads;
+    int **ints;           /* the column of each variable read as integer */
+    double **reals;       /* or as double */
+} readbatch;
+
+/* no R API in these, which the workers use too */
+
+static const char *OpenFile(readfile *f)
 {
-    i=((i==NA_INTEGER) & !naok ? STATA_INT_NA : i);
-    if (fwrite(&i, sizeof(int), 1, fp) != 1)
-	error("a binary write error occured");
+    int zip;
+    const char *err;
 
+    f->in.fp=fopen(f->path, "rb");
+    if (!f->in.fp)
+        return "unable to open file";
+    zip=zip_detect(f->in.fp);
+    if (zip!=ZIP_NONE){
+        f->in.uz=unzip_open(f->in.fp,zip,&err);
+        if (!f->in.uz){
+            fclose(f->in.fp);
+            f->in.fp=NULL;
+            return err;
+        }
+    }
+    return NULL;
 }
 
-static void OutByteBinary(unsigned char i, FILE * fp)
-{ 
-    if (fwrite(&i, sizeof(char), 1, fp) != 1)
-	error("a binary write error occured");
+static void CloseFile(readfile *f)
+{
+    CloseInput(&f->in);
+    f->in.fp=NULL;
+    f->in.uz=NULL;
 }
 
-static void OutShortIntBinary(int i,FILE * fp)
+static FILE *FileData(readfile *f)
 {
-  unsigned char first,second;
-  
-  if (endian==LOHI){
-    first= (i>>8);
-    second=i & 0xff;
-  } 
-  else {
-    first=i & 0xff;
-    second=i>>8;
-  }
-  if (fwrite(&first, sizeof(char), 1, fp) != 1)
-    error("a binary write error occured");
-  if (fwrite(&second, sizeof(char), 1, fp) != 1)
-    error("a binary write error occured");
+    return f->in.uz ? unzip_file(f->in.uz) : f->in.fp;
 }
 
+/* the header is read through this, to learn where the data start */
 
-static void  OutDoubleBinary(double d, FILE * fp, int naok)
+static size_t CountedRead(dtasource *src, void *buf, size_t n)
 {
-    d=(R_FINITE(d) ? d : STATA_DOUBLE_NA);
-    if (fwrite(&d, sizeof(double), 1, fp) != 1)
-	error("a binary write error occured");
+    readfile *f=src->data;
+    size_t got=fread(buf,1,n,FileData(f));
+
+    f->start+=got;
+    return got;
 }
 
+/* reopens f at the start of its data; a compressed file is read up to there */
 
-static void OutStringBinary(char *buffer, FILE * fp, int nchar)
+static const char *SeekData(readfile *f)
 {
-    if (fwrite(buffer, nchar, 1, fp) != 1)
-	error("a binary write error occured");
+    char skip[4096];
+    size_t n, left=f->start;
+    const char *err;
+
+    if ((err=OpenFile(f)))
+        return err;
+    if (!f->in.uz)
+        return fseeko(f->in.fp,(off_t) f->start,SEEK_SET)==0 ? NULL
+            : "a binary read error occured";
+    for(;left>0;left-=n){
+        n=(left<sizeof(skip) ? left : sizeof(skip));
+        if (fread(skip,1,n,FileData(f))!=n)
+            return "a binary read error occured";
+    }
+    return NULL;
 }
 
-static char* nameMangleOut(char *stataname, int len){
-    int i;
-    for(i=0;i<len;i++){
-      if (stataname[i]=='.') stataname[i]='_';
+static void DecodeFile(void *data, int task, int thread)
+{
+    readbatch *b=data;
+    readfile *f=b->rf+task;
+    dtasource src;
+    blockreader *br;
+    const unsigned char *block;
+    int i,j,r,nrec,width,reclen=f->h.offsets[b->nvar];
+
+    if ((f->err=SeekData(f))) {
+        CloseFile(f);
+        return;
     }
-    return stataname;
+    source_file(&src,FileData(f));
+    br=blockreader_open(&src,reclen,f->h.nobs,
+                        b->direct ? BLOCKREADER_DIRECT : 0);
+    if (!br) {
+        f->err="cannot allocate buffer for data";
+        CloseFile(f);
+        return;
+    }
+    for(i=0;i<f->h.nobs;i+=nrec){
+        block=blockreader_next(br,&nrec);
+        if (!block) {
+            f->err=blockreader_error(br);
+            break;
+        }
+        for(j=0;j<b->nvar;j++){
+            if (b->ints[j])
+                DecodeNumbers(block+f->h.offsets[j],reclen,nrec,f->h.types[j],
+                              f->endian,b->ints[j]+f->first+i,NULL);
+            else if (b->reals[j])
+                DecodeNumbers(block+f->h.offsets[j],reclen,nrec,f->h.types[j],
+                              f->endian,NULL,b->reals[j]+f->first+i);
+            else {
+                width=f->h.types[j]-STATA_STRINGOFFSET;
+                for(r=0;r<nrec;r++)
+                    memcpy(f->strings[j]+(size_t) (i+r)*width,
+                           block+(size_t) r*reclen+f->h.offsets[j],width);
+            }
+        }
+    }
+    blockreader_close(br);
+    CloseFile(f);
 }
 
-void R_SaveStataData(FILE *fp, SEXP df)
+/* a variable is read as double if it is a float or double in any file */
+
+static int ManyColumnType(readbatch *b, int j)
 {
-    int i,j,k,l,nvar,nobs,charlen;
-    char datalabel[81]="Written by R.              ", timestamp[18], aname[9];
-    char format9g[12]="%9.0g", strformat[12]="";
-    SEXP names,types;
-    
-    k=0; /* -Wall */
+    int i,type=0;
 
+    for(i=0;i<b->nfiles;i++){
+        switch (b->rf[i].h.types[j]) {
+        case STATA_FLOAT:
+        case STATA_DOUBLE:
+            if (type==STRSXP)
+                return NILSXP;
+            type=REALSXP;
+            break;
+        case STATA_INT:
+        case STATA_SHORTINT:
+        case STATA_BYTE:
+            if (type==STRSXP)
+                return NILSXP;
+            if (type!=REALSXP)
+                type=INTSXP;
+            break;
+        default:
+            if (type && type!=STRSXP)
+                return NILSXP;
+            type=STRSXP;
+            break;
+        }
+    }
+    return type;
+}
 
-    setup_consts();  /*endianness*/
+static SEXP LoadFiles(void *data)
+{
+    readbatch *b=data;
+    readfile *f, *f0=b->rf;
+    dtasource src;
+    const char *err;
+    int i,j,r,width,nvar;
+    double total=0;
+    SEXP df, col;
+    char sbuf[256];
 
-    /** first write the header **/
-    
-    OutByteBinary((char) 108,fp);            /* release */
-    OutByteBinary((char) endian,fp);
-    OutByteBinary(1,fp);            /* filetype */
-    OutByteBinary(0,fp);            /* padding */
+    /** headers, which must all have the variables of the first **/
 
-    nvar=length(df);
-    OutShortIntBinary(nvar,fp);
-    nobs=length(VECTOR_ELT(df,0));
-    OutIntegerBinary(nobs,fp,1);  /* number of cases */
-    OutStringBinary(datalabel,fp,81);   /* data label - zero terminated string */
-    for(i=0;i<18;i++){
-      timestamp[i]=0;
+    for(i=0;i<b->nfiles;i++){
+        f=b->rf+i;
+        f->name=CHAR(STRING_ELT(b->files,i));
+        f->path=R_ExpandFileName(f->name);
+        f->path=strcpy(R_alloc(strlen(f->path)+1, 1),f->path);
+        if ((err=OpenFile(f)))
+            error("%s: %s", f->name, err);
+        memset(&src, 0, sizeof(dtasource));
+        src.read=CountedRead;
+        src.data=f;
+        ReadHeader(&src,&f->h);
+        f->endian=stata_endian;
+        CloseFile(f);
+        if (f->h.nvar!=f0->h.nvar)
+            error("%s has %d variables but %s has %d", f->name, f->h.nvar,
+                  f0->name, f0->h.nvar);
+        for(j=0;j<f->h.nvar;j++)
+            if (strncmp(f->h.names[j],f0->h.names[j],9))
+                error("variable %d is '%s' in %s but '%s' in %s", j+1,
+                      f->h.names[j], f->name, f0->h.names[j], f0->name);
+        f->first=(int) total;
+        total+=f->h.nobs;
+        if (total>2147483647)
+            error("too many cases for a data frame");
     }
-    OutStringBinary(timestamp,fp,18);   /* file creation time - zero terminated string */
-  
-   
-    
+    nvar=b->nvar=f0->h.nvar;
+
+    /** the columns, for all the cases **/
+
+    PROTECT(df=allocVector(VECSXP, nvar));
+    b->ints=(int **) R_alloc(nvar+1, sizeof(int *));
+    b->reals=(double **) R_alloc(nvar+1, sizeof(double *));
+    for(i=0;i<b->nfiles;i++){
+        b->rf[i].strings=calloc(nvar+1, sizeof(char *));
+        if (!b->rf[i].strings)
+            error("cannot allocate memory for strings");
+    }
+    for(j=0;j<nvar;j++){
+        b->ints[j]=NULL;
+        b->reals[j]=NULL;
+        switch (ManyColumnType(b,j)) {
+        case REALSXP:
+            SET_VECTOR_ELT(df,j,allocVector(REALSXP,(int) total));
+            b->reals[j]=REAL(VECTOR_ELT(df,j));
+            break;
+        case INTSXP:
+            SET_VECTOR_ELT(df,j,allocVector(INTSXP,(int) total));
+            b->ints[j]=INTEGER(VECTOR_ELT(df,j));
+            break;
+        case STRSXP:
+            SET_VECTOR_ELT(df,j,allocVector(STRSXP,(int) total));
+            for(i=0;i<b->nfiles;i++){
+                f=b->rf+i;
+                width=f->h.types[j]-STATA_STRINGOFFSET;
+                f->strings[j]=malloc((size_t) f->h.nobs*width+1);
+                if (!f->strings[j])
+                    error("cannot allocate memory for strings");
+            }
+            break;
+        default:
+            error("variable '%s' is a string in some files and a number in others",
+                  f0->h.names[j]);
+        }
+    }
+
+    /** the data, a file at a time on each thread **/
+
+    parallel_for(b->threads, b->nfiles, DecodeFile, b);
+    for(i=0;i<b->nfiles;i++)
+        if (b->rf[i].err)
+            error("%s: %s", b->rf[i].name, b->rf[i].err);
+
+    /** strings are made here, where the R API can be called **/
+
+    for(j=0;j<nvar;j++){
+        if (b->ints[j] || b->reals[j])
+            continue;
+        col=VECTOR_ELT(df,j);
+        for(i=0;i<b->nfiles;i++){
+            f=b->rf+i;
+            width=f->h.types[j]-STATA_STRINGOFFSET;
+            for(r=0;r<f->h.nobs;r++){
+                memcpy(sbuf,f->strings[j]+(size_t) r*width,width);
+                sbuf[width]=0;
+                SET_STRING_ELT(col,f->first+r,mkChar(sbuf));
+            }
+            free(f->strings[j]);
+            f->strings[j]=NULL;
+        }
+    }
+
+    LabelFrame(df,&f0->h,(int) total);
+    UNPROTECT(1);
+    return df;
+}
+
+static void CloseFiles(void *data)
+{
+    readbatch *b=data;
+    readfile *f;
+    int i,j;
+
+    for(i=0;i<b->nfiles;i++){
+        f=b->rf+i;
+        if (f->strings) {
+            for(j=0;j<b->nvar;j++)
+                free(f->strings[j]);
+            free(f->strings);
+        }
+        CloseInput(&f->in);
+    }
+}
+
+/**
+   A character vector of file names, read in turn into one data
+   frame on up to threads threads.  Its labels and formats are those
+   of the first file.
+**/
+
+SEXP do_readStataMany(SEXP call)
+{
+    SEXP files;
+    readbatch b;
+
+    if ((sizeof(double)!=8) | (sizeof(int)!=4) | (sizeof(float)!=4))
+      error("can't yet read Stata .dta on this platform");
+
+    files=CADR(call);
+    if (!isString(files) || LENGTH(files)<1)
+        error("first argument must be file names");
+    memset(&b, 0, sizeof(readbatch));
+    b.files=files;
+    b.nfiles=LENGTH(files);
+    b.direct=asLogical(CADDR(call));
+    if (b.direct==NA_LOGICAL)
+	error("'direct' must be TRUE or FALSE");
+    b.threads=asInteger(CADDDR(call));
+    if (b.threads==NA_INTEGER || b.threads<1)
+        error("'threads' must be a positive integer");
+    b.rf=(readfile *) R_alloc(b.nfiles, sizeof(readfile));
+    memset(b.rf, 0, b.nfiles*sizeof(readfile));
+    return R_ExecWithCleanup(LoadFiles, &b, CloseFiles, &b);
+}
+
+
+/** low level output, through a staging buffer written out in large chunks **/
+
+#define OUTBUFSIZE (4*1024*1024)
+
+typedef struct {
+    datasink *sink;
+    unsigned char *buf;
+    size_t len, size;
+} outbuffer;
+
+static void OutFlush(outbuffer *ob)
+{
+    if (ob->len>0 && ob->sink->write(ob->sink, ob->buf, ob->len) != ob->len)
+	error("a binary write error occured");
+    ob->len=0;
+}
+
+/* room for n (<= ob->size) more bytes; the caller fills them and adds n to len */
+
+static unsigned char *OutReserve(outbuffer *ob, size_t n)
+{
+    if (ob->len+n > ob->size)
+	OutFlush(ob);
+    return ob->buf+ob->len;
+}
+
+static void OutIntegerBinary(int i, outbuffer *ob, int naok)
+{
+    i=((i==NA_INTEGER) & !naok ? STATA_INT_NA : i);
+    memcpy(OutReserve(ob,sizeof(int)), &i, sizeof(int));
+    ob->len+=sizeof(int);
+}
+
+static void OutByteBinary(unsigned char i, outbuffer *ob)
+{ 
+    *OutReserve(ob,1)=i;
+    ob->len++;
+}
+
+static void OutShortIntBinary(int i,outbuffer *ob)
+{
+  unsigned char *p=OutReserve(ob,2);
+  
+  if (endian==LOHI){
+    p[0]= (i>>8);
+    p[1]=i & 0xff;
+  } 
+  else {
+    p[0]=i & 0xff;
+    p[1]=i>>8;
+  }
+  ob->len+=2;
+}
+
+
+static void OutStringBinary(const char *buffer, outbuffer *ob, int nchar)
+{
+    memcpy(OutReserve(ob,nchar), buffer, nchar);
+    ob->len+=nchar;
+}
+
+static void OutZeroBinary(outbuffer *ob, int nchar)
+{
+    memset(OutReserve(ob,nchar), 0, nchar);
+    ob->len+=nchar;
+}
+
+static char* nameMangleOut(char *stataname, int len){
+    int i;
+    for(i=0;i<len;i++){
+      if (stataname[i]=='.') stataname[i]='_';
+    }
+    return stataname;
+}
+
+
+/** Options to R_SaveStataData **/
+
+typedef struct {
+    int threads;     /* for scanning, encoding and writing */
+    int narrow;      /* write numbers in the smallest type that holds them */
+    int raw;         /* return the file as a raw vector */
+    const int *rows; /* write only these rows, from 0, or NULL for all */
+    int nrows;       /* how many of them */
+    const int *sortby; /* sort the rows by these variables, from 0 */
+    int nsort;       /* how many of them */
+} writeoptions;
+
+
+/** Encoding records: column data pointers are looked up once, not per cell **/
+
+typedef struct {
+    int type;           /* SEXPTYPE of the column */
+    int stype;          /* Stata type it is written as */
+    int offset;         /* in the record */
+    int width;          /* in the record */
+    const int *ints;    /* logical and integer columns */
+    const double *reals;
+    const char **chars; /* string columns, collected up front */
+    unsigned char *lens;  /* and their lengths, at most width */
+    SEXP levels;        /* of a factor, written as a value label; else R_NilValue */
+    SEXP altrep;        /* an ALTREP column with no data pointer, read a window
+                           of rows at a time (see FillWindow()); else R_NilValue */
+    void *window;       /* and the rows read from it */
+    const int *rows;    /* rows of ints or reals to write, from 0; NULL for
+                           all.  Strings are collected in this order. */
+} outcolumn;
+
+/**
+   Records are encoded a tile of rows at a time, one column after
+   another, so each kernel below runs a tight loop over one type.
+   Missing values are first mapped to Stata's codes in a contiguous
+   copy of the tile, in a loop the compiler can turn into vector
+   compares and blends, and then stored at the column's offset in
+   each record.
+
+   Nothing here calls the R API, so records can be encoded on
+   worker threads.
+**/
+
+#define ENCODE_TILE 256
+
+static int StataNA(int stype)
+{
+    switch (stype) {
+    case STATA_BYTE:
+        return STATA_BYTE_NA;
+    case STATA_SHORTINT:
+        return STATA_SHORTINT_NA;
+    default:
+        return STATA_INT_NA;
+    }
+}
+
+/* store a tile of byte, int or long values, already mapped */
+
+static void StoreInts(const int *v, int n, int stype, unsigned char *p, int reclen)
+{
+    int r;
+    short sval;
+
+    switch (stype) {
+    case STATA_BYTE:
+        for(r=0;r<n;r++,p+=reclen)
+            *p=(unsigned char) v[r];
+        break;
+    case STATA_SHORTINT:
+        for(r=0;r<n;r++,p+=reclen){
+            sval=(short) v[r];
+            memcpy(p,&sval,sizeof(short));
+        }
+        break;
+    default:
+        for(r=0;r<n;r++,p+=reclen)
+            memcpy(p,v+r,sizeof(int));
+        break;
+    }
+}
+
+static void ScatterInt(const int *x, int n, int stype, unsigned char *p, int reclen)
+{
+    int r, na=StataNA(stype), v[ENCODE_TILE];
+
+    for(r=0;r<n;r++)
+        v[r]=(x[r]==NA_INTEGER ? na : x[r]);
+    StoreInts(v,n,stype,p,reclen);
+}
+
+/* integers too large for a Stata long */
+
+static void ScatterIntDouble(const int *x, int n, unsigned char *p, int reclen)
+{
+    int r;
+    double v[ENCODE_TILE];
+
+    for(r=0;r<n;r++)
+        v[r]=(x[r]==NA_INTEGER ? STATA_DOUBLE_NA : x[r]);
+    for(r=0;r<n;r++,p+=reclen)
+        memcpy(p,v+r,sizeof(double));
+}
+
+/* integers for a float variable of an existing file */
+
+static void ScatterIntFloat(const int *x, int n, unsigned char *p, int reclen)
+{
+    int r;
+    float v[ENCODE_TILE];
+
+    for(r=0;r<n;r++)
+        v[r]=(float) (x[r]==NA_INTEGER ? STATA_FLOAT_NA : x[r]);
+    for(r=0;r<n;r++,p+=reclen)
+        memcpy(p,v+r,sizeof(float));
+}
+
+/* x-x is 0 exactly when x is finite, and unlike R_FINITE() this
+   does not need a function call */
+
+static void ScatterWholeDouble(const double *x, int n, int stype,
+                               unsigned char *p, int reclen)
+{
+    int r, na=StataNA(stype), v[ENCODE_TILE];
+
+    for(r=0;r<n;r++)
+        v[r]=(x[r]-x[r]==0 ? (int) x[r] : na);
+    StoreInts(v,n,stype,p,reclen);
+}
+
+static void ScatterFloat(const double *x, int n, unsigned char *p, int reclen)
+{
+    int r;
+    float v[ENCODE_TILE];
+
+    for(r=0;r<n;r++)
+        v[r]=(float) (x[r]-x[r]==0 ? x[r] : STATA_FLOAT_NA);
+    for(r=0;r<n;r++,p+=reclen)
+        memcpy(p,v+r,sizeof(float));
+}
+
+static void ScatterDouble(const double *x, int n, unsigned char *p, int reclen)
+{
+    int r;
+    double v[ENCODE_TILE];
+
+    for(r=0;r<n;r++)
+        v[r]=(x[r]-x[r]==0 ? x[r] : STATA_DOUBLE_NA);
+    for(r=0;r<n;r++,p+=reclen)
+        memcpy(p,v+r,sizeof(double));
+}
+
+static void ScatterString(const char **x, const unsigned char *len, int n,
+                          int width, unsigned char *p, int reclen)
+{
+    int r;
+
+    for(r=0;r<n;r++,p+=reclen){
+        memcpy(p,x[r],len[r]);
+        memset(p+len[r],0,width-len[r]);
+    }
+}
+
+/* a tile of m values from row first, gathered into buf if only some rows are written */
+
+static const int *TileInts(outcolumn *col, int first, int m, int *buf)
+{
+    int r;
+
+    if (!col->rows)
+        return col->ints+first;
+    for(r=0;r<m;r++)
+        buf[r]=col->ints[col->rows[first+r]];
+    return buf;
+}
+
+static const double *TileReals(outcolumn *col, int first, int m, double *buf)
+{
+    int r;
+
+    if (!col->rows)
+        return col->reals+first;
+    for(r=0;r<m;r++)
+        buf[r]=col->reals[col->rows[first+r]];
+    return buf;
+}
+
+/* encode rows first..first+n-1 as n consecutive records at out */
+
+static void EncodeRecords(outcolumn *cols, int nvar, int reclen,
+                          int first, int n, unsigned char *out)
+{
+    int i,j,m,ibuf[ENCODE_TILE];
+    double rbuf[ENCODE_TILE];
+    const int *x;
+    const double *y;
+    unsigned char *p;
+
+    for(i=0;i<n;i+=m){
+        m=(n-i<ENCODE_TILE ? n-i : ENCODE_TILE);
+        for(j=0;j<nvar;j++){
+            p=out+(size_t) i*reclen+cols[j].offset;
+            switch (cols[j].type) {
+            case LGLSXP:
+            case INTSXP:
+                x=TileInts(cols+j,first+i,m,ibuf);
+                if (cols[j].stype==STATA_DOUBLE)
+                    ScatterIntDouble(x,m,p,reclen);
+                else if (cols[j].stype==STATA_FLOAT)
+                    ScatterIntFloat(x,m,p,reclen);
+                else
+                    ScatterInt(x,m,cols[j].stype,p,reclen);
+                break;
+            case REALSXP:
+                y=TileReals(cols+j,first+i,m,rbuf);
+                if (cols[j].stype==STATA_DOUBLE)
+                    ScatterDouble(y,m,p,reclen);
+                else if (cols[j].stype==STATA_FLOAT)
+                    ScatterFloat(y,m,p,reclen);
+                else
+                    ScatterWholeDouble(y,m,cols[j].stype,p,reclen);
+                break;
+            case STRSXP:
+                ScatterString(cols[j].chars+first+i,cols[j].lens+first+i,m,
+                              cols[j].width,p,reclen);
+                break;
+            }
+        }
+    }
+}
+
+/**
+   ALTREP columns that cannot give a pointer to their data are read
+   WINDOW_ROWS rows at a time with *_GET_REGION(), on the main thread,
+   so a compact sequence or a lazily loaded column is never expanded
+   in memory; if only some rows are written they are read one by one
+   with *_ELT().  FillWindow() makes wcols a copy of cols for rows
+   first.. of which row 0 is row first; it returns how many rows the
+   window holds.
+**/
+
+#ifdef HAVE_ALTREP
+static void ReadWindow(outcolumn *col, int first, int n)
+{
+    int k;
+    int *ibuf=col->window;
+    double *rbuf=col->window;
+
+    if (col->rows) {
+        for(k=0;k<n;k++){
+            switch (col->type) {
+            case LGLSXP:
+                ibuf[k]=LOGICAL_ELT(col->altrep,col->rows[first+k]);
+                break;
+            case INTSXP:
+                ibuf[k]=INTEGER_ELT(col->altrep,col->rows[first+k]);
+                break;
+            default:
+                rbuf[k]=REAL_ELT(col->altrep,col->rows[first+k]);
+                break;
+            }
+        }
+        return;
+    }
+    switch (col->type) {
+    case LGLSXP:
+        LOGICAL_GET_REGION(col->altrep,first,n,ibuf);
+        break;
+    case INTSXP:
+        INTEGER_GET_REGION(col->altrep,first,n,ibuf);
+        break;
+    default:
+        REAL_GET_REGION(col->altrep,first,n,rbuf);
+        break;
+    }
+}
+#endif
+
+#define WINDOW_ROWS (1024*1024)
+
+static int FillWindow(outcolumn *cols, outcolumn *wcols, int nvar,
+                      int first, int n)
+{
+    int j;
+
+    if (n>WINDOW_ROWS)
+        n=WINDOW_ROWS;
+    for(j=0;j<nvar;j++){
+        wcols[j]=cols[j];
+        switch (cols[j].type) {
+        case LGLSXP:
+        case INTSXP:
+#ifdef HAVE_ALTREP
+            if (cols[j].altrep!=R_NilValue) {
+                ReadWindow(cols+j,first,n);
+                wcols[j].ints=cols[j].window;
+                wcols[j].rows=NULL;
+                break;
+            }
+#endif
+            if (cols[j].rows)
+                wcols[j].rows=cols[j].rows+first;
+            else
+                wcols[j].ints=cols[j].ints+first;
+            break;
+        case REALSXP:
+#ifdef HAVE_ALTREP
+            if (cols[j].altrep!=R_NilValue) {
+                ReadWindow(cols+j,first,n);
+                wcols[j].reals=cols[j].window;
+                wcols[j].rows=NULL;
+                break;
+            }
+#endif
+            if (cols[j].rows)
+                wcols[j].rows=cols[j].rows+first;
+            else
+                wcols[j].reals=cols[j].reals+first;
+            break;
+        case STRSXP:
+            wcols[j].chars=cols[j].chars+first;
+            wcols[j].lens=cols[j].lens+first;
+            break;
+        }
+    }
+    return n;
+}
+
+static int AnyWindowed(outcolumn *cols, int nvar)
+{
+    int j;
+
+    for(j=0;j<nvar;j++)
+        if (cols[j].altrep!=R_NilValue)
+            return 1;
+    return 0;
+}
+
+/**
+   Narrowing: each numeric column is written in the smallest Stata
+   type that holds all its values exactly.  Factors are left with the
+   type DefaultTypes() gives them, which holds every level.  The ranges leave out the
+   codes that later versions of Stata reserve for missing values.
+   The scan runs over blocks of rows of each column on worker threads.
+**/
+
+#define STATA_BYTE_MIN (-127)
+#define STATA_BYTE_MAX 100
+#define STATA_SHORTINT_MIN (-32767)
+#define STATA_SHORTINT_MAX 32740
+#define STATA_INT_MIN (-2147483647)
+#define STATA_INT_MAX 2147483620
+#define STATA_FLOAT_MAX 1.70141173319e38
+
+#define SCAN_BLOCK (1024*1024)
+
+typedef struct {
+    double min, max;
+    int any;       /* any non-missing values */
+    int whole;     /* all whole numbers */
+    int single;    /* all exact as floats */
+} colrange;
+
+typedef struct {
+    outcolumn *cols;
+    int *scanned;  /* the columns to scan */
+    int nobs, nblocks;
+    colrange *ranges;  /* nblocks for each scanned column */
+} rangescan;
+
+/* the range of rows first..last-1 of col */
+
+static void ScanRange(outcolumn *col, int first, int last, colrange *cr)
+{
+    int i,k;
+    double x, min=0, max=0;
+    int any=0, whole=1, single=1;
+
+    const int *rows=col->rows;
+
+    if (col->type==REALSXP) {
+        for(i=first;i<last;i++){
+            x=col->reals[rows ? rows[i] : i];
+            if (x-x!=0)
+                continue;
+            if (!any || x<min)
+                min=x;
+            if (!any || x>max)
+                max=x;
+            any=1;
+            whole=whole && (x==floor(x));
+            single=single && ((double) (float) x==x);
+        }
+        single=single && min>=-STATA_FLOAT_MAX && max<=STATA_FLOAT_MAX;
+    } else {
+        for(i=first;i<last;i++){
+            k=col->ints[rows ? rows[i] : i];
+            if (k==NA_INTEGER)
+                continue;
+            if (!any || k<min)
+                min=k;
+            if (!any || k>max)
+                max=k;
+            any=1;
+        }
+        single=0;
+    }
+    cr->min=min;
+    cr->max=max;
+    cr->any=any;
+    cr->whole=whole;
+    cr->single=single;
+}
+
+static void MergeRange(colrange *all, colrange *cr)
+{
+    if (cr->any){
+        if (!all->any || cr->min<all->min)
+            all->min=cr->min;
+        if (!all->any || cr->max>all->max)
+            all->max=cr->max;
+        all->any=1;
+    }
+    all->whole=all->whole && cr->whole;
+    all->single=all->single && cr->single;
+}
+
+static void ScanBlock(void *data, int task, int thread)
+{
+    rangescan *rs=data;
+    int first=(task%rs->nblocks)*SCAN_BLOCK, last=first+SCAN_BLOCK;
+
+    if (last>rs->nobs)
+        last=rs->nobs;
+    ScanRange(rs->cols+rs->scanned[task/rs->nblocks],first,last,rs->ranges+task);
+}
+
+static int NarrowType(int type, colrange *cr)
+{
+    if (!cr->any)
+        return STATA_BYTE;
+    if (cr->whole) {
+        if (cr->min>=STATA_BYTE_MIN && cr->max<=STATA_BYTE_MAX)
+            return STATA_BYTE;
+        if (cr->min>=STATA_SHORTINT_MIN && cr->max<=STATA_SHORTINT_MAX)
+            return STATA_SHORTINT;
+        if (cr->min>=STATA_INT_MIN && cr->max<=STATA_INT_MAX)
+            return STATA_INT;
+    }
+    if (type==REALSXP && cr->single)
+        return STATA_FLOAT;
+    return STATA_DOUBLE;
+}
+
+static void NarrowTypes(outcolumn *cols, int nvar, int nobs, int threads)
+{
+    rangescan rs;
+    colrange all, part, *cr;
+    outcolumn window;
+    int i,j,k,nscan=0;
+
+    rs.cols=cols;
+    rs.nobs=nobs;
+    rs.nblocks=(nobs>0 ? (nobs-1)/SCAN_BLOCK+1 : 1);
+    rs.scanned=(int *) R_alloc(nvar, sizeof(int));
+    for(j=0;j<nvar;j++)
+        if (cols[j].type!=STRSXP && cols[j].levels==R_NilValue
+            && cols[j].altrep==R_NilValue)
+            rs.scanned[nscan++]=j;
+    rs.ranges=(colrange *) R_alloc((size_t) nscan*rs.nblocks, sizeof(colrange));
+    parallel_for(threads,nscan*rs.nblocks,ScanBlock,&rs);
+
+    for(k=0;k<nscan;k++){
+        cr=rs.ranges+k*rs.nblocks;
+        all=cr[0];
+        for(i=1;i<rs.nblocks;i++)
+            MergeRange(&all,cr+i);
+        j=rs.scanned[k];
+        cols[j].stype=NarrowType(cols[j].type,&all);
+        cols[j].width=StataTypeWidth(cols[j].stype);
+    }
+
+    /* windowed columns on this thread */
+    for(j=0;j<nvar;j++){
+        if (cols[j].altrep==R_NilValue || cols[j].levels!=R_NilValue)
+            continue;
+        all.any=0;
+        all.whole=1;
+        all.single=1;
+        for(i=0;i<nobs;i+=k){
+            k=FillWindow(cols+j,&window,1,i,nobs-i);
+            ScanRange(&window,0,k,&part);
+            MergeRange(&all,&part);
+        }
+        cols[j].stype=NarrowType(cols[j].type,&all);
+        cols[j].width=StataTypeWidth(cols[j].stype);
+    }
+}
+
+
+/**
+   String widths: one pass over the CHAR() pointers of each string
+   column, in blocks of rows on worker threads, finds the longest
+   value and keeps every length for the encoder.
+**/
+
+#define STATA_MAX_STRLEN 80
+
+typedef struct {
+    outcolumn *cols;
+    int *scanned;
+    int nobs, nblocks;
+    int *maxlen;   /* nblocks for each scanned column */
+} widthscan;
+
+static void ScanWidths(void *data, int task, int thread)
+{
+    widthscan *ws=data;
+    outcolumn *col=ws->cols+ws->scanned[task/ws->nblocks];
+    int i, first=(task%ws->nblocks)*SCAN_BLOCK, last=first+SCAN_BLOCK;
+    size_t k, max=0;
+
+    if (last>ws->nobs)
+        last=ws->nobs;
+    for(i=first;i<last;i++){
+        k=strlen(col->chars[i]);
+        if (k>max)
+            max=k;
+        col->lens[i]=(k>STATA_MAX_STRLEN ? STATA_MAX_STRLEN : k);
+    }
+    ws->maxlen[task]=(max>STATA_MAX_STRLEN ? STATA_MAX_STRLEN+1 : (int) max);
+}
+
+/* with fixed, the columns keep the widths they have and longer values are cut */
+
+static void StringWidths(outcolumn *cols, int nvar, int nobs, int threads,
+                         SEXP names, int fixed)
+{
+    widthscan ws;
+    int i,j,k,width,nscan=0;
+
+    ws.cols=cols;
+    ws.nobs=nobs;
+    ws.nblocks=(nobs>0 ? (nobs-1)/SCAN_BLOCK+1 : 1);
+    ws.scanned=(int *) R_alloc(nvar, sizeof(int));
+    for(j=0;j<nvar;j++)
+        if (cols[j].type==STRSXP)
+            ws.scanned[nscan++]=j;
+    ws.maxlen=(int *) R_alloc((size_t) nscan*ws.nblocks, sizeof(int));
+    parallel_for(threads,nscan*ws.nblocks,ScanWidths,&ws);
+
+    for(k=0;k<nscan;k++){
+        width=0;
+        for(i=0;i<ws.nblocks;i++)
+            if (ws.maxlen[k*ws.nblocks+i]>width)
+                width=ws.maxlen[k*ws.nblocks+i];
+        j=ws.scanned[k];
+        if (fixed && width>cols[j].width) {
+            warning("strings in '%s' truncated to %d characters",
+                    CHAR(STRING_ELT(names,j)), cols[j].width);
+            for(i=0;i<nobs;i++)
+                if (cols[j].lens[i]>cols[j].width)
+                    cols[j].lens[i]=cols[j].width;
+        } else if (!fixed) {
+            if (width>STATA_MAX_STRLEN) {
+                warning("strings in '%s' truncated to %d characters",
+                        CHAR(STRING_ELT(names,j)), STATA_MAX_STRLEN);
+                width=STATA_MAX_STRLEN;
+            }
+            cols[j].width=width;
+            cols[j].stype=width+STATA_STRINGOFFSET;
+        }
+    }
+}
+
+
+/** Several threads each encode a block of rows, straight into
+    memory or into a buffer they write to its place in the file **/
+
+typedef struct {
+    outcolumn *cols;
+    int nvar, nobs, reclen, blockrecs;
+    unsigned char *mem;    /* of the data section, or */
+    unsigned char **bufs;  /* one per thread */
+#ifdef STATA_THREADS
+    int fd;
+    off_t offset;          /* of the data section */
+#endif
+    int err;
+} rowwriter;
+
+static void WriteRowBlock(void *data, int task, int thread)
+{
+    rowwriter *w=data;
+    int first=task*w->blockrecs, n=w->nobs-first;
+
+    if (n>w->blockrecs)
+        n=w->blockrecs;
+    if (w->mem) {
+        EncodeRecords(w->cols,w->nvar,w->reclen,first,n,
+                      w->mem+(size_t) first*w->reclen);
+        return;
+    }
+#ifdef STATA_THREADS
+    EncodeRecords(w->cols,w->nvar,w->reclen,first,n,w->bufs[thread]);
+    if (!pwrite_full(w->fd,w->bufs[thread],(size_t) n*w->reclen,
+                     w->offset+(off_t) first*w->reclen))
+        w->err=1;
+#endif
+}
+
+static void EncodeRowsParallel(unsigned char *mem, outcolumn *cols, int nvar,
+                               int nobs, int reclen, int threads)
+{
+    rowwriter w;
+
+    w.cols=cols;
+    w.nvar=nvar;
+    w.nobs=nobs;
+    w.reclen=reclen;
+    w.blockrecs=OUTBUFSIZE/reclen;
+    if (w.blockrecs<1)
+        w.blockrecs=1;
+    w.mem=mem;
+    w.err=0;
+    parallel_for(threads,(nobs-1)/w.blockrecs+1,WriteRowBlock,&w);
+}
+
+#ifdef STATA_THREADS
+
+static void WriteRowsParallel(FILE *fp, outcolumn *cols, int nvar, int nobs,
+                              int reclen, int threads)
+{
+    rowwriter w;
+    int i,nblocks;
+    /* called for each window of a windowed table: the buffers go again
+       at the end, not when .External returns */
+    const void *vmax=vmaxget();
+
+    w.cols=cols;
+    w.nvar=nvar;
+    w.nobs=nobs;
+    w.reclen=reclen;
+    w.blockrecs=OUTBUFSIZE/reclen;
+    if (w.blockrecs<1)
+        w.blockrecs=1;
+    nblocks=(nobs-1)/w.blockrecs+1;
+    if (threads>nblocks)
+        threads=nblocks;
+    w.bufs=(unsigned char **) R_alloc(threads, sizeof(unsigned char *));
+    for(i=0;i<threads;i++)
+        w.bufs[i]=(unsigned char *) R_alloc((size_t) w.blockrecs*reclen, 1);
+    w.mem=NULL;
+    w.fd=fileno(fp);
+    w.offset=ftello(fp);
+    w.err=0;
+    parallel_for(threads,nblocks,WriteRowBlock,&w);
+    vmaxset(vmax);
+    if (w.err)
+        error("a binary write error occured");
+    /* leave fp at the end of the data */
+    if (fseeko(fp,w.offset+(off_t) nobs*reclen,SEEK_SET)!=0)
+        error("a binary write error occured");
+}
+
+/* whether fp is a file that can be written at arbitrary offsets */
+
+static int CanWriteAt(FILE *fp)
+{
+    return fileno(fp)>=0 && ftello(fp)>=0;
+}
+#endif
+
+/** Pieces shared by the writers **/
+
+/**
+   An ALTREP column is used in place if it has a pointer to its data,
+   and is otherwise read a window at a time; 0 if col is not ALTREP.
+**/
+
+static int BindAltrep(outcolumn *oc, SEXP col, int nobs)
+{
+#ifdef HAVE_ALTREP
+    const void *data;
+
+    if (!ALTREP(col))
+        return 0;
+    data=DATAPTR_OR_NULL(col);
+    if (data) {
+        if (TYPEOF(col)==REALSXP)
+            oc->reals=data;
+        else
+            oc->ints=data;
+        return 1;
+    }
+    oc->altrep=col;
+    oc->window=R_alloc(nobs<WINDOW_ROWS ? nobs+1 : WINDOW_ROWS,
+                       TYPEOF(col)==REALSXP ? sizeof(double) : sizeof(int));
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/**
+   Points cols at the columns of df.  With rows, only those nobs rows
+   of df (numbered from 0) are written, in that order.
+**/
+
+static void BindColumns(outcolumn *cols, SEXP df, int nobs, const int *rows)
+{
+    int i,j,nvar=length(df);
+    SEXP col;
+
+    for(i=0;i<nvar;i++){
+      col=VECTOR_ELT(df,i);
+      cols[i].type=TYPEOF(col);
+      cols[i].levels=(isFactor(col) ? getAttrib(col,R_LevelsSymbol) : R_NilValue);
+      cols[i].altrep=R_NilValue;
+      cols[i].rows=rows;
+      switch(TYPEOF(col)){
+        case LGLSXP:
+	  if (!BindAltrep(cols+i,col,nobs))
+	    cols[i].ints=LOGICAL(col);
+	  break;
+        case INTSXP:
+	  if (!BindAltrep(cols+i,col,nobs))
+	    cols[i].ints=INTEGER(col);
+	  break;
+	case REALSXP:
+	  if (!BindAltrep(cols+i,col,nobs))
+	    cols[i].reals=REAL(col);
+	  break;
+        case STRSXP:
+	  cols[i].chars=(const char **) R_alloc(nobs, sizeof(char *));
+	  cols[i].lens=(unsigned char *) R_alloc(nobs, 1);
+	  for(j=0;j<nobs;j++)
+	    cols[i].chars[j]=CHAR(STRING_ELT(col,rows ? rows[j] : j));
+	  break;
+	default:
+	  error("Unknown data type");
+	  break;
+      }
+    }
+}
+
+/* the smallest type for the codes of a factor with n levels */
+
+static int LevelType(int n)
+{
+    if (n<=STATA_BYTE_MAX)
+        return STATA_BYTE;
+    if (n<=STATA_SHORTINT_MAX)
+        return STATA_SHORTINT;
+    return STATA_INT;
+}
+
+/**
+   long for integers, double for numbers, and the codes of factors in
+   a type to hold all their levels; string widths are found by
+   StringWidths()
+**/
+
+static void DefaultTypes(outcolumn *cols, int nvar)
+{
+    int i;
+
+    for(i=0;i<nvar;i++){
+      switch(cols[i].type){
+        case LGLSXP:
+        case INTSXP:
+	  if (cols[i].levels!=R_NilValue)
+	    cols[i].stype=LevelType(length(cols[i].levels));
+	  else
+	    cols[i].stype=STATA_INT;
+	  break;
+	case REALSXP:
+	  cols[i].stype=STATA_DOUBLE;
+	  break;
+	default:
+	  continue;
+      }
+      cols[i].width=StataTypeWidth(cols[i].stype);
+    }
+}
+
+/* where each variable goes in a record; returns the record length */
+
+static int RecordLayout(outcolumn *cols, int nvar)
+{
+    int i,reclen=0;
+
+    for(i=0;i<nvar;i++){
+      cols[i].offset=reclen;
+      reclen+=cols[i].width;
+    }
+    return reclen;
+}
+
+/* sortlist is the variables the rows are sorted by, from 1 and ended by 0, or NULL */
+
+/**
+   The names of the value labels of factors: the variable's name cut to
+   8 characters, with a number on the end where that is already the
+   name of an earlier factor's label, so that no two share a table.
+**/
+
+static char (*LabelNames(outcolumn *cols, int nvar, SEXP names))[9]
+{
+    int i,j,k,n;
+    char (*lnames)[9], suffix[12];
+
+    lnames=(char (*)[9]) R_alloc(nvar+1, 9);
+    for(i=0;i<nvar;i++){
+        memset(lnames[i],0,9);
+        if (cols[i].levels==R_NilValue)
+            continue;
+        strncpy(lnames[i],CHAR(STRING_ELT(names,i)),8);
+        nameMangleOut(lnames[i],8);
+        for(k=1;;k++){
+            for(j=0;j<i;j++)
+                if (cols[j].levels!=R_NilValue && !strcmp(lnames[i],lnames[j]))
+                    break;
+            if (j==i)
+                break;
+            n=sprintf(suffix,"%d",k);
+            memset(lnames[i],0,9);
+            strncpy(lnames[i],CHAR(STRING_ELT(names,i)),8-n);
+            nameMangleOut(lnames[i],8-n);
+            strcpy(lnames[i]+strlen(lnames[i]),suffix);
+        }
+    }
+    return lnames;
+}
+
+static void WriteHeader(outbuffer *ob, outcolumn *cols, int nvar, int nobs,
+                        SEXP names, const int *sortlist)
+{
+    int i;
+    char datalabel[81]="Written by R.              ", timestamp[18], aname[9];
+    char format9g[12]="%9.0g", strformat[12]="";
+    char (*lnames)[9];
+
+    /** first write the header **/
+    
+    OutByteBinary((char) 108,ob);            /* release */
+    OutByteBinary((char) endian,ob);
+    OutByteBinary(1,ob);            /* filetype */
+    OutByteBinary(0,ob);            /* padding */
+
+    OutShortIntBinary(nvar,ob);
+    OutIntegerBinary(nobs,ob,1);  /* number of cases */
+    OutStringBinary(datalabel,ob,81);   /* data label - zero terminated string */
+    for(i=0;i<18;i++){
+      timestamp[i]=0;
+    }
+    OutStringBinary(timestamp,ob,18);   /* file creation time - zero terminated string */
+  
+   
+    
     /** write variable descriptors **/
     
     /** types **/
-    /* FIXME: writes everything as double or integer to save effort*/
+
+    for(i=0;i<nvar;i++)
+      OutByteBinary((unsigned char) cols[i].stype,ob);
+
+    /** names truncated to 8 characters**/
+    
+    for (i=0;i<nvar;i++){
+ 	strncpy(aname,CHAR(STRING_ELT(names,i)),8);
+        OutStringBinary(nameMangleOut(aname,8),ob,8);
+	OutByteBinary(0,ob);
+    }
+
+
+
+    /** sortlist **/
+
+    for(i=0;sortlist && sortlist[i];i++)
+        OutShortIntBinary(sortlist[i],ob);
+    OutZeroBinary(ob,2*(nvar+1-i));
+    
+    /** format list: arbitrarily write numbers as %9g format
+	but strings need accurate types */
+    for (i=0;i<nvar;i++){
+        if (cols[i].type==STRSXP){
+          /* string types are at most 128 characters
+              so we can't get a buffer overflow in sprintf **/	   
+	    sprintf(strformat,"%%%ds",cols[i].width);
+	    OutStringBinary(strformat,ob,12);
+	} else { 
+	    OutStringBinary(format9g,ob,12);
+	}
+    }
+
+    /** value labels.  These are stored as the names of label formats, 
+	which are themselves stored after the data.  Factors have one
+	each, named after the variable. **/
+ 
+    lnames=LabelNames(cols,nvar,names);
+    for(i=0;i<nvar;i++)
+        OutStringBinary(lnames[i],ob,9);
+	
+
+    /** Variable Labels -- full R name of column**/
+     
+
+    for(i=0;i<nvar;i++) {
+        strncpy(datalabel,CHAR(STRING_ELT(names,i)),81);
+	datalabel[80]=(char) 0;
+        OutStringBinary(datalabel,ob,81);
+    }
+
+
+    
+
+    /** variable 'characteristics' -- not relevant**/
+    OutZeroBinary(ob,3);
+}
+
+/**
+   Value labels, after the data: for each factor, the length of its
+   table, its name and 3 bytes of padding, then the table: the number
+   of levels n, the length of their text, n offsets into the text,
+   the n values 1..n, and the text, each level ended by a 0 byte.
+   Levels are cut to 80 characters, as strings are.
+**/
+
+static int LevelLength(SEXP levels, int k)
+{
+    size_t len=strlen(CHAR(STRING_ELT(levels,k)));
+
+    return (int) (len>STATA_MAX_STRLEN ? STATA_MAX_STRLEN : len);
+}
+
+static size_t LabelTableSize(SEXP levels)
+{
+    int k,n=length(levels);
+    size_t txtlen=0;
+
+    for(k=0;k<n;k++)
+        txtlen+=LevelLength(levels,k)+1;
+    return 8+(size_t) 8*n+txtlen;
+}
+
+/* bytes after the data section */
+
+static size_t ValueLabelsSize(outcolumn *cols, int nvar)
+{
+    int i;
+    size_t size=0;
+
+    for(i=0;i<nvar;i++)
+        if (cols[i].levels!=R_NilValue)
+            size+=4+9+3+LabelTableSize(cols[i].levels);
+    return size;
+}
+
+static void WriteValueLabels(outbuffer *ob, outcolumn *cols, int nvar,
+                             SEXP names)
+{
+    int i,k,n,off,len;
+    char (*lnames)[9]=LabelNames(cols,nvar,names);
+    SEXP levels;
+
+    for(i=0;i<nvar;i++){
+        levels=cols[i].levels;
+        if (levels==R_NilValue)
+            continue;
+        n=length(levels);
+        OutIntegerBinary((int) LabelTableSize(levels),ob,1);
+        OutStringBinary(lnames[i],ob,9);
+        OutZeroBinary(ob,3);
+
+        OutIntegerBinary(n,ob,1);
+        off=0;
+        for(k=0;k<n;k++)
+            off+=LevelLength(levels,k)+1;
+        OutIntegerBinary(off,ob,1);
+        off=0;
+        for(k=0;k<n;k++){
+            OutIntegerBinary(off,ob,1);
+            off+=LevelLength(levels,k)+1;
+        }
+        for(k=0;k<n;k++)
+            OutIntegerBinary(k+1,ob,1);
+        for(k=0;k<n;k++){
+            len=LevelLength(levels,k);
+            OutStringBinary(CHAR(STRING_ELT(levels,k)),ob,len);
+            OutZeroBinary(ob,1);
+        }
+    }
+    OutFlush(ob);
+}
+
+/** The Data, encoded straight into memory or the staging buffer, or
+    by several threads at once if we can write anywhere in the file **/
+
+static void WriteRecordRange(outbuffer *ob, outcolumn *cols, int nvar,
+                             int nobs, int reclen, int threads)
+{
+    int i,j;
+    datasink *sink=ob->sink;
+
+    if (sink->mem && nobs>0 && reclen>0){
+        OutFlush(ob);
+        if (sink->len-sink->pos<(size_t) nobs*reclen)
+            error("a binary write error occured");
+        EncodeRowsParallel(sink->mem+sink->pos,cols,nvar,nobs,reclen,threads);
+        sink->pos+=(size_t) nobs*reclen;
+        return;
+    }
+#ifdef STATA_THREADS
+    if (threads>1 && nobs>0 && reclen>0 && sink->fp && CanWriteAt(sink->fp)){
+        OutFlush(ob);
+        if (fflush(sink->fp)!=0)
+            error("a binary write error occured");
+        WriteRowsParallel(sink->fp,cols,nvar,nobs,reclen,threads);
+        return;
+    }
+#endif
+    for(i=0;i<nobs && reclen>0;i+=j){
+        OutReserve(ob,reclen);
+        j=(ob->size-ob->len)/reclen;
+        if (j>nobs-i)
+            j=nobs-i;
+        EncodeRecords(cols,nvar,reclen,i,j,ob->buf+ob->len);
+        ob->len+=(size_t) j*reclen;
+    }
+    OutFlush(ob);
+}
+
+/* windowed columns are read, and their records written, a window at a time */
+
+static void WriteRecords(outbuffer *ob, outcolumn *cols, int nvar,
+                         int nobs, int reclen, int threads)
+{
+    int i,n;
+    outcolumn *wcols;
+
+    if (!AnyWindowed(cols,nvar)) {
+        WriteRecordRange(ob,cols,nvar,nobs,reclen,threads);
+        return;
+    }
+    wcols=(outcolumn *) R_alloc(nvar, sizeof(outcolumn));
+    for(i=0;i<nobs;i+=n){
+        n=FillWindow(cols,wcols,nvar,i,nobs-i);
+        WriteRecordRange(ob,wcols,nvar,n,reclen,threads);
+    }
+}
+
+/** Fitting new rows to the variables of an existing file **/
+
+/* whether a variable of Stata type have holds every value of type need */
+
+static int TypeHolds(int have, int need)
+{
+    switch (have) {
+    case STATA_DOUBLE:
+        return 1;
+    case STATA_FLOAT:
+    case STATA_INT:
+        return need==STATA_BYTE || need==STATA_SHORTINT || need==have;
+    case STATA_SHORTINT:
+        return need==STATA_BYTE || need==have;
+    default:
+        return need==have;
+    }
+}
+
+/**
+   Factors are written by their codes, which mean the same only if
+   their levels are those of the variable's value label, given for
+   each variable by levels (R_NilValue for a variable without one).
+**/
+
+static void FitLevels(outcolumn *cols, int nvar, SEXP levels, SEXP names)
+{
+    int j,k,n;
+    SEXP have;
+
+    for(j=0;j<nvar;j++){
+        have=VECTOR_ELT(levels,j);
+        if (cols[j].levels==R_NilValue && have==R_NilValue)
+            continue;
+        if (cols[j].levels==R_NilValue)
+            error("'%s' is not a factor but its variable in the file has value labels",
+                  CHAR(STRING_ELT(names,j)));
+        if (have==R_NilValue)
+            error("'%s' is a factor but its variable in the file has no value labels",
+                  CHAR(STRING_ELT(names,j)));
+        n=length(have);
+        if (length(cols[j].levels)!=n)
+            error("levels of '%s' do not match the value labels of its variable",
+                  CHAR(STRING_ELT(names,j)));
+        for(k=0;k<n;k++)
+            if (strcmp(CHAR(STRING_ELT(cols[j].levels,k)),CHAR(STRING_ELT(have,k))))
+                error("levels of '%s' do not match the value labels of its variable",
+                      CHAR(STRING_ELT(names,j)));
+    }
+}
+
+/**
+   Gives cols the types of the variables, stypes, after checking that
+   every value fits and, unless levels is R_NilValue, that factors
+   match the value labels.  Strings too long for their variable are an
+   error or, with truncate, are cut short with a warning.
+**/
+
+static void FitColumns(outcolumn *cols, int nvar, int nobs, int threads,
+                       const int *stypes, SEXP levels, SEXP names, int truncate)
+{
+    int j,width;
+
+    for(j=0;j<nvar;j++)
+        if ((stypes[j]>STATA_STRINGOFFSET)!=(cols[j].type==STRSXP))
+            error("'%s' does not match the type of its variable in the file",
+                  CHAR(STRING_ELT(names,j)));
+    if (levels!=R_NilValue)
+        FitLevels(cols,nvar,levels,names);
+    DefaultTypes(cols,nvar);
+    NarrowTypes(cols,nvar,nobs,threads);
+    for(j=0;j<nvar;j++){
+        if (cols[j].type==STRSXP) {
+            cols[j].width=stypes[j]-STATA_STRINGOFFSET;
+        } else if (!TypeHolds(stypes[j],cols[j].stype)) {
+            error("values of '%s' do not fit the type of its variable in the file: write files to be added to with narrow=FALSE",
+                  CHAR(STRING_ELT(names,j)));
+        }
+        cols[j].stype=stypes[j];
+    }
+    if (truncate) {
+        StringWidths(cols,nvar,nobs,threads,names,1);
+    } else {
+        StringWidths(cols,nvar,nobs,threads,names,0);
+        for(j=0;j<nvar;j++){
+            if (cols[j].type!=STRSXP)
+                continue;
+            width=stypes[j]-STATA_STRINGOFFSET;
+            if (cols[j].width>width)
+                error("strings in '%s' are longer than the %d characters of its variable",
+                      CHAR(STRING_ELT(names,j)), width);
+            cols[j].stype=stypes[j];
+        }
+    }
+    for(j=0;j<nvar;j++)
+        cols[j].width=StataTypeWidth(cols[j].stype);
+}
+
+/* bytes before the data section */
+
+static size_t HeaderSize(int nvar)
+{
+    return 4+2+4+81+18                  /* header */
+        +(size_t) nvar*(1+9+12+9+81)    /* descriptors */
+        +2*((size_t) nvar+1)            /* sortlist */
+        +3;                             /* characteristics */
+}
+
+/* files at least this large are written through a mapping */
+#define MAP_MINSIZE OUTBUFSIZE
+
+/** Sorting the rows to be written, by a least significant digit
+    radix sort on several threads: each thread counts the digits of
+    a block of rows, and then moves them to their places **/
+
+#define SORT_BLOCK (1024*1024)
+#define RADIX_BITS 8
+#define RADIX (1<<RADIX_BITS)
+#define SORT_MISSING (~(uint64_t) 0)   /* after every value, as in Stata */
+
+typedef struct {
+    int n, shift;
+    uint64_t *key, *key2;
+    int *order, *order2;
+    size_t *counts;    /* RADIX for each block, then where they go */
+} radixpass;
+
+static void CountDigits(void *data, int task, int thread)
+{
+    radixpass *rp=data;
+    size_t *c=rp->counts+(size_t) task*RADIX;
+    int i, first=task*SORT_BLOCK, last=first+SORT_BLOCK;
+
+    if (last>rp->n)
+        last=rp->n;
+    memset(c,0,RADIX*sizeof(size_t));
+    for(i=first;i<last;i++)
+        c[(rp->key[i]>>rp->shift)&(RADIX-1)]++;
+}
+
+static void MoveDigits(void *data, int task, int thread)
+{
+    radixpass *rp=data;
+    size_t k, *at=rp->counts+(size_t) task*RADIX;
+    int i, first=task*SORT_BLOCK, last=first+SORT_BLOCK;
+
+    if (last>rp->n)
+        last=rp->n;
+    for(i=first;i<last;i++){
+        k=at[(rp->key[i]>>rp->shift)&(RADIX-1)]++;
+        rp->key2[k]=rp->key[i];
+        rp->order2[k]=rp->order[i];
+    }
+}
+
+/* stable sort of order[] by key[], on the low bits of key */
+
+static void RadixSort(radixpass *rp, int bits, int threads)
+{
+    int b,d,nblocks=(rp->n-1)/SORT_BLOCK+1;
+    size_t total,c;
+    uint64_t *tk;
+    int *to;
+
+    for(rp->shift=0;rp->shift<bits;rp->shift+=RADIX_BITS){
+        parallel_for(threads,nblocks,CountDigits,rp);
+        /* a digit that every row shares does not move any */
+        for(d=0;d<RADIX;d++){
+            for(total=0,b=0;b<nblocks;b++)
+                total+=rp->counts[(size_t) b*RADIX+d];
+            if (total!=0)
+                break;
+        }
+        if (total==(size_t) rp->n)
+            continue;
+        for(total=0,d=0;d<RADIX;d++)
+            for(b=0;b<nblocks;b++){
+                c=rp->counts[(size_t) b*RADIX+d];
+                rp->counts[(size_t) b*RADIX+d]=total;
+                total+=c;
+            }
+        parallel_for(threads,nblocks,MoveDigits,rp);
+        tk=rp->key; rp->key=rp->key2; rp->key2=tk;
+        to=rp->order; rp->order=rp->order2; rp->order2=to;
+    }
+}
+
+/**
+   SortKeys() sets key[i] for row order[i] of col, so that the keys
+   are in the order Stata sorts the values in, and returns how many of
+   their bits are used.  Strings are ranked by a comparison sort.
+**/
+
+typedef struct {
+    const char *s;
+    int i;
+} rankedstring;
+
+static int CompareStrings(const void *a, const void *b)
+{
+    return strcmp(((const rankedstring *) a)->s, ((const rankedstring *) b)->s);
+}
+
+static int SortKeys(SEXP col, const int *order, int n, uint64_t *key)
+{
+    int i,r;
+    double x;
+    uint64_t u;
+    const int *ints=NULL;
+    const double *reals=NULL;
+    rankedstring *rs;
+
+    switch (TYPEOF(col)) {
+    case LGLSXP:
+    case INTSXP:
+#ifdef HAVE_ALTREP
+        if (ALTREP(col))
+            ints=DATAPTR_OR_NULL(col);
+        else
+#endif
+        ints=(TYPEOF(col)==LGLSXP ? LOGICAL(col) : INTEGER(col));
+        for(i=0;i<n;i++){
+#ifdef HAVE_ALTREP
+            if (!ints)
+                r=(TYPEOF(col)==LGLSXP ? LOGICAL_ELT(col,order[i])
+                   : INTEGER_ELT(col,order[i]));
+            else
+#endif
+            r=ints[order[i]];
+            key[i]=(r==NA_INTEGER ? SORT_MISSING : (uint32_t) r^0x80000000u);
+        }
+        return 32;
+    case REALSXP:
+#ifdef HAVE_ALTREP
+        if (ALTREP(col))
+            reals=DATAPTR_OR_NULL(col);
+        else
+#endif
+        reals=REAL(col);
+        for(i=0;i<n;i++){
+#ifdef HAVE_ALTREP
+            if (!reals)
+                x=REAL_ELT(col,order[i]);
+            else
+#endif
+            x=reals[order[i]];
+            /* infinite values are written as missing */
+            if (x-x!=0) {
+                key[i]=SORT_MISSING;
+                continue;
+            }
+            if (x==0)
+                x=0;   /* not -0 */
+            memcpy(&u,&x,sizeof(double));
+            key[i]=(u>>63 ? ~u : u|((uint64_t) 1<<63));
+        }
+        return 64;
+    case STRSXP:
+        rs=(rankedstring *) R_alloc(n>0 ? n : 1, sizeof(rankedstring));
+        for(i=0;i<n;i++){
+            rs[i].s=CHAR(STRING_ELT(col,order[i]));
+            rs[i].i=i;
+        }
+        qsort(rs,n,sizeof(rankedstring),CompareStrings);
+        for(r=0,i=0;i<n;i++){
+            if (i>0 && strcmp(rs[i].s,rs[i-1].s)!=0)
+                r=i;
+            key[rs[i].i]=(uint64_t) r;
+        }
+        return 32;
+    default:
+        error("Unknown data type");
+    }
+    return 0;
+}
+
+/**
+   Puts the rows order[0..n-1] of df in order of the variables sortby
+   (numbered from 0), the first of them varying slowest, keeping rows
+   with equal values in the order they were in.
+**/
+
+static void SortRows(SEXP df, const int *sortby, int nsort, int *order,
+                     int n, int threads)
+{
+    radixpass rp;
+    int k,bits;
+
+    if (n<2)
+        return;
+    rp.n=n;
+    rp.key=(uint64_t *) R_alloc(n, sizeof(uint64_t));
+    rp.key2=(uint64_t *) R_alloc(n, sizeof(uint64_t));
+    rp.order=order;
+    rp.order2=(int *) R_alloc(n, sizeof(int));
+    rp.counts=(size_t *) R_alloc((size_t) ((n-1)/SORT_BLOCK+1)*RADIX, sizeof(size_t));
+    for(k=nsort-1;k>=0;k--){
+        bits=SortKeys(VECTOR_ELT(df,sortby[k]),rp.order,n,rp.key);
+        RadixSort(&rp,bits,threads);
+    }
+    if (rp.order!=order)
+        memcpy(order,rp.order,n*sizeof(int));
+}
+
+/**
+   Everything after the sizes are known.  A mapping of the file is
+   undone however this ends: on an error, the file is left empty.
+**/
+
+typedef struct {
+    outbuffer ob;
+    outcolumn *cols;
+    int nvar, nobs, reclen, threads;
+    SEXP names;
+    const int *sortlist;
+    FILE *fp;        /* mapped at map, or NULL */
+    void *map;
+    size_t size;
+} filecontents;
+
+static SEXP WriteContents(void *data)
+{
+    filecontents *fc=data;
+
+    WriteHeader(&fc->ob,fc->cols,fc->nvar,fc->nobs,fc->names,fc->sortlist);
+    WriteRecords(&fc->ob,fc->cols,fc->nvar,fc->nobs,fc->reclen,fc->threads);
+    WriteValueLabels(&fc->ob,fc->cols,fc->nvar,fc->names);
+#ifdef STATA_THREADS
+    if (fc->map) {
+        void *map=fc->map;
+
+        fc->map=NULL;
+        if (!unmap_output(map,fc->size))
+            error("a binary write error occured");
+    }
+#endif
+    return R_NilValue;
+}
+
+static void CloseContents(void *data)
+{
+#ifdef STATA_THREADS
+    filecontents *fc=data;
+
+    if (fc->map)
+        discard_output(fc->map,fc->size,fc->fp);
+#endif
+}
+
+/**
+   Writes df to sink or, with opt->raw, into a raw vector of exactly
+   the right size, which is returned.  A large enough file is sized
+   up front and mapped, and then written exactly like a raw vector.
+**/
+
+SEXP R_SaveStataData(datasink *sink, SEXP df, writeoptions *opt)
+{
+    int i,nvar,nobs,reclen;
+    int *order, *sortlist=NULL;
+    const int *rows=opt->rows;
+    SEXP names, result=R_NilValue;
+    filecontents fc;
+    outcolumn *cols;
+    size_t size;
+    void *map=NULL;
+    datasink mapped;
     
-    PROTECT(types=allocVector(INTSXP,nvar));
 
-    for(i=0;i<nvar;i++){
-      switch(TYPEOF(VECTOR_ELT(df,i))){
-        case LGLSXP:
-        case INTSXP:
-	  OutByteBinary(STATA_INT,fp);
-	  break;
-	case REALSXP:
-	  OutByteBinary(STATA_DOUBLE,fp);
-	  break;
-        case STRSXP:
-	  charlen=0;
-	  for(j=0;j<nobs;j++){
-	    k=length(STRING_ELT(VECTOR_ELT(df,i),j));
-	    if (k>charlen)
-	      charlen=k;
-	  }
-	  OutByteBinary((unsigned char)(k+STATA_STRINGOFFSET),fp);
-	  INTEGER(types)[i]=k;
-	  break;
-	default:
-	  error("Unknown data type");
-	  break;
-      }
+    setup_consts();  /*endianness*/
+
+    nvar=length(df);
+    nobs=(opt->rows ? opt->nrows : length(VECTOR_ELT(df,0)));
+    cols=(outcolumn *) R_alloc(nvar, sizeof(outcolumn));
+
+    /** the order of the rows, if they are sorted **/
+
+    if (opt->nsort>0) {
+        order=(int *) R_alloc(nobs>0 ? nobs : 1, sizeof(int));
+        for(i=0;i<nobs;i++)
+            order[i]=(rows ? rows[i] : i);
+        SortRows(df,opt->sortby,opt->nsort,order,nobs,opt->threads);
+        rows=order;
+        sortlist=(int *) R_alloc(opt->nsort+1, sizeof(int));
+        for(i=0;i<opt->nsort;i++)
+            sortlist[i]=opt->sortby[i]+1;
+        sortlist[opt->nsort]=0;
+    }
+
+    /** types, and where each variable goes in a record **/
+
+    BindColumns(cols,df,nobs,rows);
+    DefaultTypes(cols,nvar);
+    PROTECT(names=getAttrib(df,R_NamesSymbol));
+    StringWidths(cols,nvar,nobs,opt->threads,names,0);
+    if (opt->narrow)
+      NarrowTypes(cols,nvar,nobs,opt->threads);
+    reclen=RecordLayout(cols,nvar);
+
+    size=HeaderSize(nvar)+(size_t) nobs*reclen+ValueLabelsSize(cols,nvar);
+    fc.fp=NULL;
+    if (opt->raw) {
+        PROTECT(result=allocVector(RAWSXP,size));
+        sink_memory(sink,RAW(result),size);
+    }
+#ifdef STATA_THREADS
+    else if (sink->fp && size>=MAP_MINSIZE
+             && (map=map_output(sink->fp,size))) {
+        sink_memory(&mapped,map,size);
+        fc.fp=sink->fp;
+        sink=&mapped;
+    }
+#endif
+
+    fc.ob.sink=sink;
+    fc.ob.len=0;
+    fc.ob.size=(reclen>OUTBUFSIZE ? reclen : OUTBUFSIZE);
+    fc.ob.buf=(unsigned char *) R_alloc(fc.ob.size, 1);
+    fc.cols=cols;
+    fc.nvar=nvar;
+    fc.nobs=nobs;
+    fc.reclen=reclen;
+    fc.threads=opt->threads;
+    fc.names=names;
+    fc.sortlist=sortlist;
+    fc.map=map;
+    fc.size=size;
+    R_ExecWithCleanup(WriteContents, &fc, CloseContents, &fc);
+
+    if (sink->mem && sink->pos!=size)
+        error("a binary write error occured");
+    if (opt->raw)
+        UNPROTECT(1); /*result*/
+    UNPROTECT(1); /*names*/
+    return result;
+}
+
+typedef struct {
+    FILE *fp;
+    zipper *zp;
+    datasink sink;
+    SEXP df;
+    writeoptions opt;
+} writeoutput;
+
+static SEXP SaveOutput(void *data)
+{
+    writeoutput *out=data;
+    zipper *zp=out->zp;
+    const char *err;
+    SEXP result;
+
+    if (zp)
+        sink_file(&out->sink, zip_file(zp));
+    result=R_SaveStataData(&out->sink, out->df, &out->opt);
+    if (zp) {
+        out->zp=NULL;
+        if ((err=zip_close(zp)))
+            error("%s", err);
+    }
+    return result;
+}
+
+static void CloseOutput(void *data)
+{
+    writeoutput *out=data;
+
+    if (out->zp)
+        zip_close(out->zp);
+    if (out->fp)
+        fclose(out->fp);
+}
+
+/**
+   The columns of df numbered (from 1) in cols, as a data frame that
+   shares them, so that a subset is written without copying.
+**/
+
+static SEXP SelectColumns(SEXP df, SEXP cols)
+{
+    int i,k,n=length(cols),nvar=length(df);
+    SEXP sub, names, subnames;
+
+    names=getAttrib(df,R_NamesSymbol);
+    PROTECT(sub=allocVector(VECSXP,n));
+    PROTECT(subnames=allocVector(STRSXP,n));
+    for(i=0;i<n;i++){
+        k=INTEGER(cols)[i];
+        if (k==NA_INTEGER || k<1 || k>nvar)
+            error("'cols' must be variables of the data frame");
+        SET_VECTOR_ELT(sub,i,VECTOR_ELT(df,k-1));
+        SET_STRING_ELT(subnames,i,STRING_ELT(names,k-1));
+    }
+    setAttrib(sub,R_NamesSymbol,subnames);
+    classgets(sub,mkString("data.frame"));
+    UNPROTECT(2);
+    return sub;
+}
+
+/* rows (from 1) of a data frame with nobs rows, as an array from 0 */
+
+static const int *SelectRows(SEXP rows, int nobs)
+{
+    int i,k,n=length(rows);
+    int *sel=(int *) R_alloc(n>0 ? n : 1, sizeof(int));
+
+    for(i=0;i<n;i++){
+        k=INTEGER(rows)[i];
+        if (k==NA_INTEGER || k<1 || k>nobs)
+            error("'rows' must be cases of the data frame");
+        sel[i]=k-1;
+    }
+    return sel;
+}
+
+/* the variables (from 1) to sort by, as an array from 0, or NULL */
+
+static const int *SelectSortVariables(SEXP sortby, int nvar, int *nsort)
+{
+    int i,j,k,n=length(sortby);
+    int *sel;
+
+    *nsort=0;
+    if (isNull(sortby))
+        return NULL;
+    if (n>nvar)
+        error("'sort_by' must be different variables that are written");
+    sel=(int *) R_alloc(n>0 ? n : 1, sizeof(int));
+    for(i=0;i<n;i++){
+        k=INTEGER(sortby)[i];
+        if (k==NA_INTEGER || k<1 || k>nvar)
+            error("'sort_by' must be different variables that are written");
+        for(j=0;j<i;j++)
+            if (sel[j]==k-1)
+                error("'sort_by' must be different variables that are written");
+        sel[i]=k-1;
+    }
+    *nsort=n;
+    return sel;
+}
+
+/**
+   The first argument is a file name, an open binary-mode connection,
+   or NULL to return the file as a raw vector.  Files whose names end
+   in .gz or .zst are compressed as they are written.  The next two
+   pick out the rows and the columns to write, or are NULL for all,
+   and the last is the variables to sort the rows by, or NULL.
+**/
+
+SEXP do_writeStata(SEXP call)
+{ 
+    SEXP fname, rows, cols, result;
+    writeoutput out;
+    const char *err;
+    int zip;
+
+    if ((sizeof(double)!=8) | (sizeof(int)!=4) | (sizeof(float)!=4))
+      error("can't yet read write .dta on this platform");
+
+
+    fname = CADR(call);
+    out.opt.threads=asInteger(CADDDR(call));
+    if (out.opt.threads==NA_INTEGER || out.opt.threads<1)
+	error("'threads' must be a positive integer");
+    out.opt.narrow=asLogical(CAD4R(call));
+    if (out.opt.narrow==NA_LOGICAL)
+	error("'narrow' must be TRUE or FALSE");
+    out.opt.raw=0;
+    out.df=CADDR(call);
+    if (!inherits(out.df,"data.frame"))
+        error("data to be saved must be in a data frame.");
+    rows=CAR(nthcdr(call,5));
+    cols=CAR(nthcdr(call,6));
+    out.opt.rows=NULL;
+    out.opt.nrows=0;
+    if (!isNull(rows)) {
+        out.opt.nrows=length(rows);
+        out.opt.rows=SelectRows(rows,length(out.df)>0 ? length(VECTOR_ELT(out.df,0)) : 0);
+    }
+    if (!isNull(cols))
+        PROTECT(out.df=SelectColumns(out.df,cols));
+    if (length(out.df)==0)
+        error("there must be at least one variable to write");
+    out.opt.sortby=SelectSortVariables(CAR(nthcdr(call,7)),length(out.df),
+                                       &out.opt.nsort);
+
+    out.fp=NULL;
+    out.zp=NULL;
+    if (isNull(fname)) {
+        out.opt.raw=1;
+    } else if (inherits(fname,"connection")) {
+#ifdef HAVE_CONNECTIONS
+        memset(&out.sink, 0, sizeof(datasink));
+        out.sink.write=ConnWrite;
+        out.sink.data=R_GetConnection(fname);
+#else
+        error("writing to connections needs R 3.3.0 or later");
+#endif
+    } else {
+        if (!isValidString(fname))
+            error("first argument must be a file name, connection or NULL\n");
+        /* read access too, to map it */
+        out.fp = fopen(R_ExpandFileName(CHAR(STRING_ELT(fname,0))), "w+b");
+        if (!out.fp)
+            error("unable to open file");
+        sink_file(&out.sink, out.fp);
+        zip=zip_suffix(CHAR(STRING_ELT(fname,0)));
+        if (zip!=ZIP_NONE){
+            out.zp=zip_open(out.fp,zip,out.opt.threads,&err);
+            if (!out.zp){
+                fclose(out.fp);
+                error("%s", err);
+            }
+        }
+    }
+ 
+    result=R_ExecWithCleanup(SaveOutput, &out, CloseOutput, &out);
+    if (!isNull(cols))
+        UNPROTECT(1); /*out.df*/
+    return result;
+}
+
+
+/** Streaming writer: the header and descriptors are written when it
+    is opened, chunks of rows are appended as they arrive, and the
+    number of cases is filled in when it is closed **/
+
+#define NOBS_OFFSET 6   /* of the number of cases in the header */
+
+typedef struct {
+    FILE *fp;
+    datasink sink;
+    int nvar, reclen, nobs, threads;
+    int *stype;
+    outbuffer ob;
+    unsigned char *labels;   /* value labels, written at the end */
+    size_t labellen;
+} streamwriter;
+
+/* no R API here: this also runs as a finalizer */
+
+static int FinishStream(streamwriter *sw)
+{
+    int ok=1;
+
+    if (sw->fp) {
+        ok=(sw->ob.len==0 || fwrite(sw->ob.buf,1,sw->ob.len,sw->fp)==sw->ob.len);
+        ok=ok && (sw->labellen==0
+                  || fwrite(sw->labels,1,sw->labellen,sw->fp)==sw->labellen);
+        ok=ok && fseek(sw->fp,NOBS_OFFSET,SEEK_SET)==0
+            && fwrite(&sw->nobs,sizeof(int),1,sw->fp)==1;
+        ok=(fclose(sw->fp)==0) && ok;
+    }
+    free(sw->ob.buf);
+    free(sw->stype);
+    free(sw->labels);
+    free(sw);
+    return ok;
+}
+
+static void StreamFinalizer(SEXP ptr)
+{
+    streamwriter *sw=R_ExternalPtrAddr(ptr);
+
+    if (sw) {
+        FinishStream(sw);
+        R_ClearExternalPtr(ptr);
+    }
+}
+
+static streamwriter *GetStream(SEXP ptr)
+{
+    streamwriter *sw;
+
+    if (TYPEOF(ptr)!=EXTPTRSXP || !inherits(ptr,"dta_writer"))
+        error("not a dta_writer");
+    sw=R_ExternalPtrAddr(ptr);
+    if (!sw)
+        error("dta_writer has been closed");
+    return sw;
+}
+
+SEXP do_openStataWriter(SEXP call)
+{
+    SEXP fname, schema, names, levels, ptr;
+    streamwriter *sw;
+    outcolumn *cols;
+    datasink lsink;
+    int i, nvar, nobs, threads;
+
+    if (!isValidString(fname = CADR(call)))
+	error("first argument must be a file name\n");
+    schema=CADDR(call);
+    if (!inherits(schema,"data.frame"))
+        error("schema must be a data frame.");
+    threads=asInteger(CADDDR(call));
+    if (threads==NA_INTEGER || threads<1)
+	error("'threads' must be a positive integer");
+
+    setup_consts();  /*endianness*/
+
+    /* the schema fixes the types, and the widths of string variables */
+    nvar=length(schema);
+    nobs=(nvar>0 ? length(VECTOR_ELT(schema,0)) : 0);
+    cols=(outcolumn *) R_alloc(nvar, sizeof(outcolumn));
+    BindColumns(cols,schema,nobs,NULL);
+    DefaultTypes(cols,nvar);
+    PROTECT(names=getAttrib(schema,R_NamesSymbol));
+    StringWidths(cols,nvar,nobs,threads,names,0);
+
+    /* chunks' factors are checked against the schema's levels */
+    PROTECT(levels=allocVector(VECSXP,nvar));
+    for(i=0;i<nvar;i++)
+        SET_VECTOR_ELT(levels,i,cols[i].levels);
+
+    sw=calloc(1,sizeof(streamwriter));
+    if (!sw)
+        error("cannot allocate dta_writer");
+    PROTECT(ptr=R_MakeExternalPtr(sw,R_NilValue,levels));
+    R_RegisterCFinalizerEx(ptr,StreamFinalizer,TRUE);
+    setAttrib(ptr,R_ClassSymbol,mkString("dta_writer"));
+
+    sw->nvar=nvar;
+    sw->threads=threads;
+    sw->reclen=RecordLayout(cols,nvar);
+    sw->stype=malloc((nvar+1)*sizeof(int));
+    sw->ob.size=(sw->reclen>OUTBUFSIZE ? sw->reclen : OUTBUFSIZE);
+    sw->ob.buf=malloc(sw->ob.size);
+    if (!sw->stype || !sw->ob.buf)
+        error("cannot allocate dta_writer");
+    for(i=0;i<nvar;i++)
+        sw->stype[i]=cols[i].stype;
+    sw->fp=fopen(R_ExpandFileName(CHAR(STRING_ELT(fname,0))), "wb");
+    if (!sw->fp)
+	error("unable to open file");
+    sink_file(&sw->sink,sw->fp);
+    sw->ob.sink=&sw->sink;
+    WriteHeader(&sw->ob,cols,nvar,0,names,NULL);
+    OutFlush(&sw->ob);
+
+    /* the value labels of factors in the schema are kept for the end */
+    sw->labellen=ValueLabelsSize(cols,nvar);
+    sw->labels=malloc(sw->labellen+1);
+    if (!sw->labels)
+        error("cannot allocate dta_writer");
+    sink_memory(&lsink,sw->labels,sw->labellen);
+    sw->ob.sink=&lsink;
+    WriteValueLabels(&sw->ob,cols,nvar,names);
+    sw->ob.sink=&sw->sink;
+
+    UNPROTECT(3);
+    return ptr;
+}
+
+SEXP do_writeStataChunk(SEXP call)
+{
+    SEXP df, names;
+    streamwriter *sw;
+    outcolumn *cols;
+    int nobs;
+
+    sw=GetStream(CADR(call));
+    df=CADDR(call);
+    if (!inherits(df,"data.frame"))
+        error("data to be saved must be in a data frame.");
+    if (length(df)!=sw->nvar)
+        error("chunk has %d variables, the dta_writer %d", length(df), sw->nvar);
+    nobs=(sw->nvar>0 ? length(VECTOR_ELT(df,0)) : 0);
+    if (nobs>2147483647-sw->nobs)
+        error("too many cases for a .dta file");
+
+    setup_consts();  /*endianness*/
+
+    cols=(outcolumn *) R_alloc(sw->nvar, sizeof(outcolumn));
+    BindColumns(cols,df,nobs,NULL);
+    PROTECT(names=getAttrib(df,R_NamesSymbol));
+    FitColumns(cols,sw->nvar,nobs,sw->threads,sw->stype,
+               R_ExternalPtrProtected(CADR(call)),names,1);
+    UNPROTECT(1);
+    RecordLayout(cols,sw->nvar);
+
+    WriteRecords(&sw->ob,cols,sw->nvar,nobs,sw->reclen,sw->threads);
+    sw->nobs+=nobs;
+    return R_NilValue;
+}
+
+SEXP do_closeStataWriter(SEXP call)
+{
+    SEXP ptr=CADR(call);
+    streamwriter *sw=GetStream(ptr);
+
+    R_ClearExternalPtr(ptr);
+    if (!FinishStream(sw))
+	error("a binary write error occured");
+    return R_NilValue;
+}
+
+
+/** Value labels already in a file, which new factor values must match **/
+
+/**
+   Value label tables after the data of a v6 file: pos is moved past
+   the next one, whose name and length are returned, or 0 at the end.
+**/
+
+static size_t NextLabelTable(const unsigned char *tail, size_t taillen,
+                             size_t *pos, char *name)
+{
+    int len;
+    size_t at=*pos, n;
+
+    if (taillen-at<4+9+3)
+        return 0;
+    memcpy(&len,tail+at,4);
+    n=4+9+3+(size_t) len;
+    if (len<0 || n>taillen-at)
+        return 0;
+    memcpy(name,tail+at+4,9);
+    name[8]=0;
+    *pos=at+n;
+    return n;
+}
+
+/* the bytes after the data, with value labels only from a v6 file */
+
+static unsigned char *ReadTail(FILE *fp, dtaheader *h, off_t start,
+                               size_t *taillen)
+{
+    off_t end=start+(off_t) h->nobs*h->offsets[h->nvar], size;
+    unsigned char *tail;
+
+    if (fseeko(fp,0,SEEK_END)!=0 || (size=ftello(fp))<0)
+        error("a binary read error occured");
+    if (size<end)
+        error("unexpected end of file in data section");
+    *taillen=(h->version5 ? 0 : (size_t) (size-end));
+    tail=(unsigned char *) R_alloc(*taillen+1, 1);
+    if (fseeko(fp,end,SEEK_SET)!=0 || fread(tail,1,*taillen,fp)!=*taillen
+        || fseeko(fp,start,SEEK_SET)!=0)
+        error("a binary read error occured");
+    return tail;
+}
+
+/**
+   The levels of the value label of each variable, R_NilValue for a
+   variable without one; a table that is not of codes 1, 2, ... has
+   no levels a factor can match.
+**/
+
+static SEXP FileLevels(dtaheader *h, const unsigned char *tail, size_t taillen)
+{
+    int j,k,n,txtlen,off,val;
+    size_t pos,at,len;
+    const unsigned char *table;
+    char aname[9], lname[9];
+    SEXP levels, lev;
+
+    PROTECT(levels=allocVector(VECSXP,h->nvar));
+    for(j=0;j<h->nvar;j++){
+        memcpy(lname,h->lblnames[j],9);
+        lname[8]=0;
+        if (!lname[0])
+            continue;
+        pos=0;
+        while((len=NextLabelTable(tail,taillen,&pos,aname)))
+            if (!strcmp(aname,lname))
+                break;
+        if (!len)
+            continue;
+        /* n, length of the text, offsets, values, text */
+        at=pos-len+4+9+3;
+        table=tail+at;
+        len-=4+9+3;
+        lev=allocVector(STRSXP,0);
+        SET_VECTOR_ELT(levels,j,lev);
+        if (len<8)
+            continue;
+        memcpy(&n,table,4);
+        memcpy(&txtlen,table+4,4);
+        if (n<0 || txtlen<0 || (size_t) 8+8*(size_t) n+txtlen>len)
+            continue;
+        for(k=0;k<n;k++){
+            memcpy(&val,table+8+4*((size_t) n+k),4);
+            memcpy(&off,table+8+4*(size_t) k,4);
+            if (val!=k+1 || off<0 || off>=txtlen
+                || !memchr(table+8+8*(size_t) n+off,0,txtlen-off))
+                break;
+        }
+        if (k<n)
+            continue;
+        lev=allocVector(STRSXP,n);
+        SET_VECTOR_ELT(levels,j,lev);
+        for(k=0;k<n;k++){
+            memcpy(&off,table+8+4*(size_t) k,4);
+            SET_STRING_ELT(lev,k,mkChar((const char *) table+8+8*(size_t) n+off));
+        }
+    }
+    UNPROTECT(1);
+    return levels;
+}
+
+
+/** Appending rows to an existing file, in place **/
+
+typedef struct {
+    FILE *fp;
+    SEXP df;
+    int threads;
+    off_t end, size;      /* of the old data, and of the file */
+    unsigned char *tail;  /* what followed the old data */
+    size_t taillen;
+    int nobs;             /* old number of cases */
+    int moved, done;      /* the tail has been overwritten; all is written */
+} appendjob;
+
+static SEXP AppendRows(void *data)
+{
+    appendjob *job=data;
+    FILE *fp=job->fp;
+    dtaheader h;
+    dtasource src;
+    datasink sink;
+    outbuffer ob;
+    outcolumn *cols;
+    SEXP names, levels;
+    off_t start,end,size;
+    size_t taillen;
+    unsigned char *tail;
+    int nvar,nobs,total,reclen;
+
+    source_file(&src,fp);
+    ReadHeader(&src,&h);
+    if (h.swapends)
+        error("can only append to files written in this machine's byte order");
+    nvar=h.nvar;
+    if (length(job->df)!=nvar)
+        error("data frame has %d variables, the file %d", length(job->df), nvar);
+    nobs=(nvar>0 ? length(VECTOR_ELT(job->df,0)) : 0);
+    if (nobs>2147483647-h.nobs)
+        error("too many cases for a .dta file");
+    reclen=h.offsets[nvar];
+
+    /* anything after the data, such as value labels, moves along */
+    start=ftello(fp);
+    end=start+(off_t) h.nobs*reclen;
+    if (start<0 || fseeko(fp,0,SEEK_END)!=0 || (size=ftello(fp))<0)
+        error("a binary read error occured");
+    if (size<end)
+        error("unexpected end of file in data section");
+    taillen=(size_t) (size-end);
+    tail=(unsigned char *) R_alloc(taillen+1, 1);
+    if (fseeko(fp,end,SEEK_SET)!=0 || fread(tail,1,taillen,fp)!=taillen)
+        error("a binary read error occured");
+
+    cols=(outcolumn *) R_alloc(nvar, sizeof(outcolumn));
+    BindColumns(cols,job->df,nobs,NULL);
+    PROTECT(names=getAttrib(job->df,R_NamesSymbol));
+    /* v5 value labels are not read, so their factors go unchecked */
+    PROTECT(levels=(h.version5 ? R_NilValue : FileLevels(&h,tail,taillen)));
+    FitColumns(cols,nvar,nobs,job->threads,h.types,levels,names,0);
+    UNPROTECT(2);
+    RecordLayout(cols,nvar);
+
+    sink_file(&sink,fp);
+    ob.sink=&sink;
+    ob.len=0;
+    ob.size=(reclen>OUTBUFSIZE ? reclen : OUTBUFSIZE);
+    ob.buf=(unsigned char *) R_alloc(ob.size, 1);
+
+    /* from here a failure puts the file back as it was: see CloseAppend */
+    job->end=end;
+    job->size=size;
+    job->tail=tail;
+    job->taillen=taillen;
+    job->nobs=h.nobs;
+    job->moved=1;
+    if (fseeko(fp,end,SEEK_SET)!=0)
+        error("a binary write error occured");
+    WriteRecords(&ob,cols,nvar,nobs,reclen,job->threads);
+    if (taillen>0 && fwrite(tail,1,taillen,fp)!=taillen)
+        error("a binary write error occured");
+
+    /* the new rows count only once they are all there */
+    total=h.nobs+nobs;
+    if (fflush(fp)!=0 || fseeko(fp,NOBS_OFFSET,SEEK_SET)!=0
+        || fwrite(&total,sizeof(int),1,fp)!=1 || fflush(fp)!=0)
+        error("a binary write error occured");
+    job->done=1;
+    return R_NilValue;
+}
+
+/* after a failure, the tail goes back after the old data and the new
+   rows are cut off; this can only be tried, as errors can't be raised */
+
+static void CloseAppend(void *data)
+{
+    appendjob *job=data;
+
+    if (job->moved && !job->done) {
+        clearerr(job->fp);
+        if (fseeko(job->fp,job->end,SEEK_SET)==0
+            && fwrite(job->tail,1,job->taillen,job->fp)==job->taillen
+            && fseeko(job->fp,NOBS_OFFSET,SEEK_SET)==0
+            && fwrite(&job->nobs,sizeof(int),1,job->fp)==1)
+            truncate_output(job->fp,job->size);
+    }
+    fclose(job->fp);
+}
+
+SEXP do_appendStata(SEXP call)
+{
+    SEXP fname;
+    appendjob job;
+
+    if (!isValidString(fname = CADR(call)))
+	error("first argument must be a file name\n");
+    job.df=CADDR(call);
+    if (!inherits(job.df,"data.frame"))
+	error("data to be saved must be in a data frame.");
+    job.threads=asInteger(CADDDR(call));
+    if (job.threads==NA_INTEGER || job.threads<1)
+	error("'threads' must be a positive integer");
+    job.moved=job.done=0;
+    job.fp=fopen(R_ExpandFileName(CHAR(STRING_ELT(fname,0))), "r+b");
+    if (!job.fp)
+	error("unable to open file");
+    return R_ExecWithCleanup(AppendRows, &job, CloseAppend, &job);
+}
+
+
+/** Overwriting cells in place: every cell is at a known offset **/
+
+typedef struct {
+    FILE *fp;
+    SEXP col, rows, values;
+} updatejob;
+
+/* the variable named, or numbered from 1, by col */
+
+static int FindVariable(dtaheader *h, SEXP col)
+{
+    int j;
+    char aname[10];
+
+    if (isString(col) && length(col)==1) {
+        for(j=0;j<h->nvar;j++){
+            memcpy(aname,h->names[j],9);
+            aname[9]=0;
+            if (!strcmp(aname,CHAR(STRING_ELT(col,0)))
+                || !strcmp(nameMangle(aname,9),CHAR(STRING_ELT(col,0))))
+                return j;
+        }
+        error("no variable '%s' in the file", CHAR(STRING_ELT(col,0)));
+    }
+    j=asInteger(col);
+    if (length(col)!=1 || j==NA_INTEGER || j<1 || j>h->nvar)
+        error("variables must be given by name or number");
+    return j-1;
+}
+
+static SEXP UpdateCells(void *data)
+{
+    updatejob *job=data;
+    dtaheader h;
+    dtasource src;
+    outcolumn cell, wcell;
+    SEXP values, names, levels, lv;
+    unsigned char *buf, *tail;
+    size_t taillen;
+    const int *rows;
+    off_t start, offset;
+    int i,j,n,nrows,nvals,width,reclen,stype;
+
+    source_file(&src,job->fp);
+    ReadHeader(&src,&h);
+    if (h.swapends)
+        error("can only update files written in this machine's byte order");
+    start=ftello(job->fp);
+    if (start<0)
+        error("a binary read error occured");
+    j=FindVariable(&h,job->col);
+    reclen=h.offsets[h.nvar];
+
+    nrows=length(job->rows);
+    rows=INTEGER(job->rows);
+    for(i=0;i<nrows;i++)
+        if (rows[i]==NA_INTEGER || rows[i]<1 || rows[i]>h.nobs)
+            error("row %d is not in the file", rows[i]);
+    nvals=length(job->values);
+    if (nvals==0 || (nvals!=1 && nvals!=nrows))
+        error("'values' must have one value, or one for each row");
+
+    /* the values are checked as a one-column data frame and encoded
+       one after another; strings too long for the variable are refused */
+    PROTECT(values=allocVector(VECSXP,1));
+    SET_VECTOR_ELT(values,0,job->values);
+    PROTECT(names=allocVector(STRSXP,1));
+    SET_STRING_ELT(names,0,mkChar(h.names[j]));
+    BindColumns(&cell,values,nvals,NULL);
+    stype=h.types[j];
+    /* factors must match the variable's value labels, except in v5 files */
+    if (h.version5) {
+        PROTECT(lv=R_NilValue);
+        PROTECT(levels=R_NilValue);
+    } else {
+        tail=ReadTail(job->fp,&h,start,&taillen);
+        PROTECT(lv=FileLevels(&h,tail,taillen));
+        PROTECT(levels=allocVector(VECSXP,1));
+        SET_VECTOR_ELT(levels,0,VECTOR_ELT(lv,j));
+    }
+    FitColumns(&cell,1,nvals,1,&stype,levels,names,0);
+    cell.offset=0;
+    width=cell.width;
+    buf=(unsigned char *) R_alloc((size_t) nvals*width, 1);
+    for(i=0;i<nvals;i+=n){
+        n=FillWindow(&cell,&wcell,1,i,nvals-i);
+        EncodeRecords(&wcell,1,width,0,n,buf+(size_t) i*width);
+    }
+    UNPROTECT(4);
+
+    for(i=0;i<nrows;i++){
+        offset=start+(off_t) (rows[i]-1)*reclen+h.offsets[j];
+#ifdef STATA_THREADS
+        if (!pwrite_full(fileno(job->fp),buf+(size_t) (i%nvals)*width,width,offset))
+            error("a binary write error occured");
+#else
+        if (fseeko(job->fp,offset,SEEK_SET)!=0
+            || fwrite(buf+(size_t) (i%nvals)*width,1,width,job->fp)!=(size_t) width)
+            error("a binary write error occured");
+#endif
+    }
+    if (fflush(job->fp)!=0)
+        error("a binary write error occured");
+    return R_NilValue;
+}
+
+static void CloseUpdate(void *data)
+{
+    fclose(((updatejob *) data)->fp);
+}
+
+SEXP do_updateStata(SEXP call)
+{
+    SEXP fname;
+    updatejob job;
+
+    if (!isValidString(fname = CADR(call)))
+	error("first argument must be a file name\n");
+    job.col=CADDR(call);
+    job.rows=CADDDR(call);
+    job.values=CAD4R(call);
+    if (TYPEOF(job.rows)!=INTSXP)
+	error("'rows' must be integer");
+    switch (TYPEOF(job.values)) {
+    case LGLSXP:
+    case INTSXP:
+    case REALSXP:
+    case STRSXP:
+	break;
+    default:
+	error("Unknown data type");
+    }
+    job.fp=fopen(R_ExpandFileName(CHAR(STRING_ELT(fname,0))), "r+b");
+    if (!job.fp)
+	error("unable to open file");
+    return R_ExecWithCleanup(UpdateCells, &job, CloseUpdate, &job);
+}
+
+
+/** Many files at once: everything that needs R is done first, on
+    this thread, and then each file is encoded and written by a
+    worker, several files at a time **/
+
+/* the descriptors of one data set, shared by every file written from it */
+
+typedef struct {
+    outcolumn *cols;
+    int nvar, reclen;
+    unsigned char *header;   /* with 0 cases, filled in for each file */
+    size_t headerlen;
+    unsigned char *labels;   /* value labels, after the data */
+    size_t labellen;
+} filelayout;
+
+typedef struct {
+    const char *path;
+    filelayout *layout;
+    const int *rows;         /* of the data set to write, or NULL for all */
+    int nobs;
+    const char *err;         /* set if it could not be written */
+} filejob;
+
+typedef struct {
+    filejob *jobs;
+} filebatch;
+
+/**
+   Workers cannot read an ALTREP column through R, so one with no
+   data pointer is expanded here instead of being read by windows.
+**/
+
+static void PinColumns(outcolumn *cols, int nvar)
+{
+    int i;
+
+    for(i=0;i<nvar;i++){
+        if (cols[i].altrep==R_NilValue)
+            continue;
+        switch (cols[i].type) {
+        case LGLSXP:
+            cols[i].ints=LOGICAL(cols[i].altrep);
+            break;
+        case INTSXP:
+            cols[i].ints=INTEGER(cols[i].altrep);
+            break;
+        default:
+            cols[i].reals=REAL(cols[i].altrep);
+            break;
+        }
+        cols[i].altrep=R_NilValue;
+    }
+}
+
+/* types, widths and encoded descriptors of df, using ob->buf to stage them */
+
+static void PrepareLayout(filelayout *fl, SEXP df, writeoptions *opt,
+                          outbuffer *ob)
+{
+    int nvar=length(df), nobs=length(VECTOR_ELT(df,0));
+    SEXP names;
+    datasink mem;
+
+    fl->nvar=nvar;
+    fl->cols=(outcolumn *) R_alloc(nvar, sizeof(outcolumn));
+    BindColumns(fl->cols,df,nobs,NULL);
+    PinColumns(fl->cols,nvar);
+    DefaultTypes(fl->cols,nvar);
+    PROTECT(names=getAttrib(df,R_NamesSymbol));
+    StringWidths(fl->cols,nvar,nobs,opt->threads,names,0);
+    if (opt->narrow)
+        NarrowTypes(fl->cols,nvar,nobs,opt->threads);
+    fl->reclen=RecordLayout(fl->cols,nvar);
+
+    fl->headerlen=HeaderSize(nvar);
+    fl->header=(unsigned char *) R_alloc(fl->headerlen, 1);
+    sink_memory(&mem,fl->header,fl->headerlen);
+    ob->sink=&mem;
+    ob->len=0;
+    WriteHeader(ob,fl->cols,nvar,0,names,NULL);
+    OutFlush(ob);
+
+    fl->labellen=ValueLabelsSize(fl->cols,nvar);
+    fl->labels=(unsigned char *) R_alloc(fl->labellen+1, 1);
+    sink_memory(&mem,fl->labels,fl->labellen);
+    WriteValueLabels(ob,fl->cols,nvar,names);
+    UNPROTECT(1);
+    if (mem.pos!=fl->labellen)
+        error("a binary write error occured");
+}
+
+/* no R API from here to RunBatch(): these run on the workers */
+
+static int WriteJobRecords(filejob *job, outcolumn *cols, FILE *fp)
+{
+    filelayout *fl=job->layout;
+    int i,n,blockrecs;
+    unsigned char *buf;
+
+    if (fl->reclen==0 || job->nobs==0)
+        return 1;
+    blockrecs=OUTBUFSIZE/fl->reclen;
+    if (blockrecs<1)
+        blockrecs=1;
+    if (blockrecs>job->nobs)
+        blockrecs=job->nobs;
+    buf=malloc((size_t) blockrecs*fl->reclen);
+    if (!buf)
+        return 0;
+    for(i=0;i<job->nobs;i+=n){
+        n=(job->nobs-i<blockrecs ? job->nobs-i : blockrecs);
+        EncodeRecords(cols,fl->nvar,fl->reclen,i,n,buf);
+        if (fwrite(buf,fl->reclen,n,fp)!=(size_t) n)
+            break;
+    }
+    free(buf);
+    return i>=job->nobs;
+}
+
+static void FreeJobColumns(filejob *job, outcolumn *cols)
+{
+    int j;
+
+    if (job->rows)
+        for(j=0;j<job->layout->nvar;j++)
+            if (cols[j].type==STRSXP) {
+                free(cols[j].chars);
+                free(cols[j].lens);
+            }
+    free(cols);
+}
+
+/* the columns of the layout for the rows of job; strings are gathered */
+
+static outcolumn *JobColumns(filejob *job)
+{
+    filelayout *fl=job->layout;
+    outcolumn *cols=calloc(fl->nvar+1,sizeof(outcolumn));
+    int j,k;
+
+    for(j=0;cols && j<fl->nvar;j++){
+        cols[j]=fl->cols[j];
+        cols[j].rows=job->rows;
+        if (cols[j].type!=STRSXP || !job->rows)
+            continue;
+        cols[j].rows=NULL;
+        cols[j].chars=malloc((job->nobs+1)*sizeof(char *));
+        cols[j].lens=malloc(job->nobs+1);
+        if (!cols[j].chars || !cols[j].lens) {
+            FreeJobColumns(job,cols);
+            return NULL;
+        }
+        for(k=0;k<job->nobs;k++){
+            cols[j].chars[k]=fl->cols[j].chars[job->rows[k]];
+            cols[j].lens[k]=fl->cols[j].lens[job->rows[k]];
+        }
+    }
+    return cols;
+}
+
+static void WriteFileJob(void *data, int task, int thread)
+{
+    filejob *job=((filebatch *) data)->jobs+task;
+    filelayout *fl=job->layout;
+    FILE *fp, *out;
+    zipper *zp=NULL;
+    outcolumn *cols;
+    const char *err=NULL;
+    int zip, ok;
+
+    if (!(cols=JobColumns(job))) {
+        job->err="cannot allocate memory";
+        return;
+    }
+    fp=fopen(job->path,"wb");
+    if (!fp) {
+        FreeJobColumns(job,cols);
+        job->err="unable to open file";
+        return;
+    }
+    out=fp;
+    zip=zip_suffix(job->path);
+    if (zip!=ZIP_NONE) {
+        if (!(zp=zip_open(fp,zip,1,&err))) {
+            fclose(fp);
+            FreeJobColumns(job,cols);
+            job->err=err;
+            return;
+        }
+        out=zip_file(zp);
+    }
+    ok=fwrite(fl->header,1,NOBS_OFFSET,out)==NOBS_OFFSET
+        && fwrite(&job->nobs,sizeof(int),1,out)==1
+        && fwrite(fl->header+NOBS_OFFSET+4,1,fl->headerlen-NOBS_OFFSET-4,out)
+           ==fl->headerlen-NOBS_OFFSET-4
+        && WriteJobRecords(job,cols,out)
+        && (fl->labellen==0
+            || fwrite(fl->labels,1,fl->labellen,out)==fl->labellen);
+    FreeJobColumns(job,cols);
+    if (zp)
+        err=zip_close(zp);
+    ok=(fclose(fp)==0) && ok;
+    if (err)
+        job->err=err;
+    else if (!ok)
+        job->err="a binary write error occured";
+}
+
+/* files[i], expanded, in memory that lasts until the .External returns */
+
+static const char *BatchPath(SEXP files, int i)
+{
+    const char *path=R_ExpandFileName(CHAR(STRING_ELT(files,i)));
+    char *copy=R_alloc(strlen(path)+1, 1);
+
+    return strcpy(copy,path);
+}
+
+static void RunBatch(filejob *jobs, int njobs, int threads)
+{
+    filebatch b;
+    int i;
+
+    b.jobs=jobs;
+    parallel_for(threads,njobs,WriteFileJob,&b);
+    for(i=0;i<njobs;i++)
+        if (jobs[i].err)
+            error("%s: %s",jobs[i].path,jobs[i].err);
+}
+
+/**
+   One data frame split by rows into several files: the arguments are
+   the data frame, the file names, a list of the rows (from 1) for
+   each file, threads and narrow.  The types and widths of the
+   variables are worked out once, over all the rows, so every file
+   has the same variables.
+**/
+
+SEXP do_writeStataPartitions(SEXP call)
+{
+    SEXP df, files, parts;
+    writeoptions opt;
+    filelayout fl;
+    filejob *jobs;
+    outbuffer ob;
+    int i, nobs, nfiles;
+
+    df=CADR(call);
+    files=CADDR(call);
+    parts=CADDDR(call);
+    if (!inherits(df,"data.frame"))
+        error("data to be saved must be in a data frame.");
+    if (length(df)==0)
+        error("there must be at least one variable to write");
+    if (!isString(files) || TYPEOF(parts)!=VECSXP || length(files)!=length(parts))
+        error("there must be a file name for each partition");
+    opt.threads=asInteger(CAD4R(call));
+    if (opt.threads==NA_INTEGER || opt.threads<1)
+	error("'threads' must be a positive integer");
+    opt.narrow=asLogical(CAR(nthcdr(call,5)));
+    if (opt.narrow==NA_LOGICAL)
+	error("'narrow' must be TRUE or FALSE");
+    opt.raw=0;
+    opt.rows=NULL;
+    opt.nsort=0;
+
+    setup_consts();  /*endianness*/
+
+    ob.size=OUTBUFSIZE;
+    ob.buf=(unsigned char *) R_alloc(ob.size, 1);
+    PrepareLayout(&fl,df,&opt,&ob);
+
+    nobs=length(VECTOR_ELT(df,0));
+    nfiles=length(files);
+    jobs=(filejob *) R_alloc(nfiles+1, sizeof(filejob));
+    for(i=0;i<nfiles;i++){
+        if (TYPEOF(VECTOR_ELT(parts,i))!=INTSXP)
+            error("'rows' must be integer");
+        jobs[i].path=BatchPath(files,i);
+        jobs[i].layout=&fl;
+        jobs[i].nobs=length(VECTOR_ELT(parts,i));
+        jobs[i].rows=SelectRows(VECTOR_ELT(parts,i),nobs);
+        jobs[i].err=NULL;
     }
+    RunBatch(jobs,nfiles,opt.threads);
+    return R_NilValue;
+}
 
-    /** names truncated to 8 characters**/
-    
-    PROTECT(names=getAttrib(df,R_NamesSymbol));
-    for (i=0;i<nvar;i++){
- 	strncpy(aname,CHAR(STRING_ELT(names,i)),8);
-        OutStringBinary(nameMangleOut(aname,8),fp,8);
-	OutByteBinary(0,fp);
+/**
+   Several data frames, each to its own file: the arguments are a list
+   of data frames, the file names, threads and narrow.
+**/
+
+SEXP do_writeStataMany(SEXP call)
+{
+    SEXP dfs, files, df;
+    writeoptions opt;
+    filelayout *layouts;
+    filejob *jobs;
+    outbuffer ob;
+    int i, nfiles;
+
+    dfs=CADR(call);
+    files=CADDR(call);
+    if (TYPEOF(dfs)!=VECSXP)
+        error("first argument must be a list of data frames");
+    if (!isString(files) || length(files)!=length(dfs))
+        error("there must be a file name for each data frame");
+    opt.threads=asInteger(CADDDR(call));
+    if (opt.threads==NA_INTEGER || opt.threads<1)
+	error("'threads' must be a positive integer");
+    opt.narrow=asLogical(CAD4R(call));
+    if (opt.narrow==NA_LOGICAL)
+	error("'narrow' must be TRUE or FALSE");
+    opt.raw=0;
+    opt.rows=NULL;
+    opt.nsort=0;
+
+    setup_consts();  /*endianness*/
+
+    nfiles=length(dfs);
+    ob.size=OUTBUFSIZE;
+    ob.buf=(unsigned char *) R_alloc(ob.size, 1);
+    layouts=(filelayout *) R_alloc(nfiles+1, sizeof(filelayout));
+    jobs=(filejob *) R_alloc(nfiles+1, sizeof(filejob));
+    for(i=0;i<nfiles;i++){
+        df=VECTOR_ELT(dfs,i);
+        if (!inherits(df,"data.frame"))
+            error("data to be saved must be in a data frame.");
+        if (length(df)==0)
+            error("there must be at least one variable to write");
+        PrepareLayout(layouts+i,df,&opt,&ob);
+        jobs[i].path=BatchPath(files,i);
+        jobs[i].layout=layouts+i;
+        jobs[i].nobs=length(VECTOR_ELT(df,0));
+        jobs[i].rows=NULL;
+        jobs[i].err=NULL;
     }
+    RunBatch(jobs,nfiles,opt.threads);
+    return R_NilValue;
+}
 
 
+/** Sorting a file that need not fit in memory: runs of records that
+    do are sorted and spilled to temporary files, and then merged,
+    all as raw records **/
 
-    /** sortlist -- not relevant **/
+typedef struct {
+    int nkeys, endian;         /* endian of the file */
+    int *types, *offsets;      /* of the key variables */
+} recordorder;
 
-    for (i=0;i<2*(nvar+1);i++)
-        OutByteBinary(0,fp);
-    
-    /** format list: arbitrarily write numbers as %9g format
-	but strings need accurate types */
-    for (i=0;i<nvar;i++){
-        if (TYPEOF(VECTOR_ELT(df,i))==STRSXP){
-          /* string types are at most 128 characters
-              so we can't get a buffer overflow in sprintf **/	   
-	    sprintf(strformat,"%%%ds",INTEGER(types)[i]);
-	    OutStringBinary(strformat,fp,12);
-	} else { 
-	    OutStringBinary(format9g,fp,12);
-	}
+/**
+   The number at p.  Each type has its own missing value, larger than
+   any other of that type; they are all returned as infinity, so that
+   they compare equal across types and after every number.
+**/
+
+static double RecordNumber(const unsigned char *p, int type, int fileendian)
+{
+    int ival, swapends=(fileendian!=endian);
+    unsigned short sval;
+    float fval;
+    double dval;
+
+    switch (type) {
+    case STATA_FLOAT:
+        memcpy(&fval,p,4);
+        dval=(swapends ? swapf(fval) : fval);
+        return (dval==STATA_FLOAT_NA ? R_PosInf : dval);
+    case STATA_DOUBLE:
+        memcpy(&dval,p,8);
+        if (swapends)
+            dval=swapd(dval);
+        return (dval==STATA_DOUBLE_NA ? R_PosInf : dval);
+    case STATA_INT:
+        memcpy(&ival,p,4);
+        if (swapends)
+            ival=swapi(ival);
+        return (ival==STATA_INT_NA ? R_PosInf : ival);
+    case STATA_SHORTINT:
+        if (fileendian==LOHI)
+            sval=(p[0]<<8) | p[1];
+        else
+            sval=(p[1]<<8) | p[0];
+        return (sval==STATA_SHORTINT_NA ? R_PosInf : (short) sval);
+    default:
+        return (p[0]==STATA_BYTE_NA ? R_PosInf : (signed char) p[0]);
+    }
+}
+
+static int CompareRecords(const unsigned char *a, const unsigned char *b,
+                          recordorder *ro)
+{
+    int k,c,t,o;
+    double x,y;
+
+    for(k=0;k<ro->nkeys;k++){
+        t=ro->types[k];
+        o=ro->offsets[k];
+        switch (t) {
+        case STATA_FLOAT:
+        case STATA_DOUBLE:
+        case STATA_INT:
+        case STATA_SHORTINT:
+        case STATA_BYTE:
+            x=RecordNumber(a+o,t,ro->endian);
+            y=RecordNumber(b+o,t,ro->endian);
+            c=(x<y ? -1 : x>y);
+            break;
+        default:
+            c=strncmp((const char *) a+o,(const char *) b+o,t-STATA_STRINGOFFSET);
+            break;
+        }
+        if (c)
+            return c;
     }
+    return 0;
+}
 
-    /** value labels.  These are stored as the names of label formats, 
-	which are themselves stored later in the file.  Not implemented**/
- 
-    for(i=0;i<9;i++)
-      aname[i]=(char) 0;
-    for(i=0;i<nvar;i++){
-        OutStringBinary(aname,fp,9);
+/* stable merge sort of n records, using tmp for as many pointers */
+
+static void SortRun(const unsigned char **recs, const unsigned char **tmp,
+                    int n, recordorder *ro)
+{
+    int width,lo,mid,hi,i,j,k;
+    const unsigned char **from=recs, **to=tmp, **t;
+
+    for(width=1;width<n;width*=2){
+        for(lo=0;lo<n;lo+=2*width){
+            mid=(lo+width<n ? lo+width : n);
+            hi=(lo+2*width<n ? lo+2*width : n);
+            for(i=lo,j=mid,k=lo;k<hi;k++)
+                if (j>=hi || (i<mid && CompareRecords(from[i],from[j],ro)<=0))
+                    to[k]=from[i++];
+                else
+                    to[k]=from[j++];
+        }
+        t=from; from=to; to=t;
     }
-	
+    if (from!=recs)
+        memcpy(recs,from,n*sizeof(unsigned char *));
+}
 
-    /** Variable Labels -- full R name of column**/
-     
+/* runs merged at once, each with a temporary file open */
+#define SORT_FANIN 64
 
-    for(i=0;i<nvar;i++) {
-        strncpy(datalabel,CHAR(STRING_ELT(names,i)),81);
-	datalabel[80]=(char) 0;
-        OutStringBinary(datalabel,fp,81);
+typedef struct {
+    FILE *fp;
+    unsigned char *buf;
+    int pos, len, left;       /* records in buf, and still in the file */
+} sortrun;
+
+typedef struct {
+    FILE *in, *out;
+    const char *outname;
+    SEXP by;
+    size_t memory;
+    const char *tmpdir;
+    unsigned char *mem;
+    int nruns;
+    sortrun *runs;
+    char **runnames;
+    int done;
+} sortjob;
+
+static int FillRun(sortrun *run, int bufrecs, int reclen)
+{
+    int n=(run->left<bufrecs ? run->left : bufrecs);
+
+    run->pos=0;
+    run->len=(int) fread(run->buf,reclen,n,run->fp);
+    run->left-=run->len;
+    return run->len==n;
+}
+
+/* whether the next record of run a comes before that of run b; ties go to the earlier run */
+
+static int RunBefore(sortjob *job, int a, int b, int reclen, recordorder *ro)
+{
+    sortrun *ra=job->runs+a, *rb=job->runs+b;
+    int c=CompareRecords(ra->buf+(size_t) ra->pos*reclen,
+                         rb->buf+(size_t) rb->pos*reclen,ro);
+
+    return c<0 || (c==0 && a<b);
+}
+
+static void SiftDown(sortjob *job, int *heap, int n, int i, int reclen,
+                     recordorder *ro)
+{
+    int c,t;
+
+    for(;;){
+        c=2*i+1;
+        if (c>=n)
+            break;
+        if (c+1<n && RunBefore(job,heap[c+1],heap[c],reclen,ro))
+            c++;
+        if (!RunBefore(job,heap[c],heap[i],reclen,ro))
+            break;
+        t=heap[i]; heap[i]=heap[c]; heap[c]=t;
+        i=c;
     }
-    UNPROTECT(1); /*names*/
+}
 
+/* merges the count runs from first into out, each read through its own buffer */
 
-    
+static void MergeRuns(sortjob *job, int first, int count, FILE *out,
+                      int reclen, size_t memsize, recordorder *ro)
+{
+    int r,n,outlen,bufrecs,*heap;
+    size_t per;
+    unsigned char *outbuf;
+    sortrun *run;
 
-    /** variable 'characteristics' -- not relevant**/
-    OutByteBinary(0,fp);
-    OutByteBinary(0,fp);
-    OutByteBinary(0,fp);
+    per=memsize/((size_t) (count+1)*reclen);
+    bufrecs=(per>2147483647 ? 2147483647 : (int) per);
+    outbuf=job->mem+(size_t) count*bufrecs*reclen;
+    heap=(int *) R_alloc(count, sizeof(int));
+    for(n=0,r=first;r<first+count;r++){
+        run=job->runs+r;
+        run->buf=job->mem+(size_t) (r-first)*bufrecs*reclen;
+        run->fp=fopen(job->runnames[r],"rb");
+        if (!run->fp)
+            error("unable to open temporary file");
+        if (!FillRun(run,bufrecs,reclen))
+            error("a binary read error occured");
+        heap[n++]=r;
+    }
+    for(r=n/2-1;r>=0;r--)
+        SiftDown(job,heap,n,r,reclen,ro);
 
+    outlen=0;
+    while(n>0){
+        run=job->runs+heap[0];
+        memcpy(outbuf+(size_t) outlen*reclen,run->buf+(size_t) run->pos*reclen,reclen);
+        if (++outlen==bufrecs) {
+            if (fwrite(outbuf,reclen,outlen,out)!=(size_t) outlen)
+                error("a binary write error occured");
+            outlen=0;
+        }
+        if (++run->pos==run->len) {
+            if (run->left==0)
+                heap[0]=heap[--n];
+            else if (!FillRun(run,bufrecs,reclen))
+                error("a binary read error occured");
+        }
+        SiftDown(job,heap,n,0,reclen,ro);
+    }
+    if (outlen>0 && fwrite(outbuf,reclen,outlen,out)!=(size_t) outlen)
+        error("a binary write error occured");
 
-    /** The Data **/
+    /* the merged runs are not needed again */
+    for(r=first;r<first+count;r++){
+        fclose(job->runs[r].fp);
+        job->runs[r].fp=NULL;
+        remove(job->runnames[r]);
+        free(job->runnames[r]);
+        job->runnames[r]=NULL;
+    }
+}
 
+/* a new temporary file for run r, open for writing */
 
-    for(i=0;i<nobs;i++){
-        for(j=0;j<nvar;j++){
-	    switch (TYPEOF(VECTOR_ELT(df,j))) {
-	    case LGLSXP:
-	        OutIntegerBinary(LOGICAL(VECTOR_ELT(df,j))[i],fp,0);
-		break;
-	    case INTSXP:
-	        OutIntegerBinary(INTEGER(VECTOR_ELT(df,j))[i],fp,0);
-		break;
-	    case REALSXP:
-	        OutDoubleBinary(REAL(VECTOR_ELT(df,j))[i],fp,0);
-		break;
-	    case STRSXP:
-	        k=length(STRING_ELT(VECTOR_ELT(df,j),i));
-	        OutStringBinary(CHAR(STRING_ELT(VECTOR_ELT(df,j),i)),fp,k);
-		for(l=INTEGER(types)[j]-k;l>0;l--)
-		    OutByteBinary(0,fp);
-	        break;
-	    default:
-	        error("This can't happen.");
-	        break;
-	    }
-	}
-    }  
-    UNPROTECT(1); /*types*/
+static FILE *NewRun(sortjob *job, int r)
+{
+    job->runnames[r]=R_tmpnam("dtasort",job->tmpdir);
+    job->runs[r].fp=fopen(job->runnames[r],"wb");
+    if (!job->runs[r].fp)
+        error("unable to open temporary file");
+    return job->runs[r].fp;
+}
 
+static void EndRun(sortjob *job, int r)
+{
+    FILE *fp=job->runs[r].fp;
 
+    job->runs[r].fp=NULL;
+    if (fclose(fp)!=0)
+        error("a binary write error occured");
 }
 
-SEXP do_writeStata(SEXP call)
-{ 
-    SEXP fname,  df;
+/**
+   Merges the runs fanin at a time into longer ones, in order so the
+   sort stays stable, until there are few enough to merge into the
+   output; only fanin+1 temporary files are open at once.
+**/
+
+static void MergeAll(sortjob *job, int reclen, size_t memsize, recordorder *ro)
+{
+    int lo=0, hi=job->nruns, fanin, first, count, r, k;
+    size_t per=memsize/reclen;
+
+    /* a buffer of at least one record for each run and the output */
+    fanin=(per<SORT_FANIN+1 ? (int) per-1 : SORT_FANIN);
+    if (fanin<2)
+        error("'memory' is too small to merge: it must hold at least 3 records, %.0f bytes",
+              3.0*reclen);
+    while(hi-lo>fanin){
+        for(first=lo;first<hi;first+=count){
+            count=(hi-first<fanin ? hi-first : fanin);
+            r=job->nruns++;
+            for(k=first;k<first+count;k++)
+                job->runs[r].left+=job->runs[k].left;
+            MergeRuns(job,first,count,NewRun(job,r),reclen,memsize,ro);
+            EndRun(job,r);
+        }
+        lo=hi;
+        hi=job->nruns;
+    }
+    MergeRuns(job,lo,hi-lo,job->out,reclen,memsize,ro);
+}
+
+/* offset of the sortlist in the header */
+
+static size_t SortlistOffset(dtaheader *h)
+{
+    return 4+2+4+(h->version5 ? 32 : 81)+18+(size_t) h->nvar*(1+9);
+}
+
+static SEXP SortFile(void *data)
+{
+    sortjob *job=data;
+    dtaheader h;
+    dtasource src;
+    recordorder ro;
+    const unsigned char **recs;
+    unsigned char *head, *tail, *p;
     FILE *fp;
+    off_t start, end, size;
+    size_t headlen, taillen, memsize, per;
+    int i, k, r, n, reclen, runrecs, nby, *vars;
+    SEXP key;
 
-    if ((sizeof(double)!=8) | (sizeof(int)!=4) | (sizeof(float)!=4))
-      error("can't yet read write .dta on this platform");
+    source_file(&src,job->in);
+    ReadHeader(&src,&h);
+    start=ftello(job->in);
+    reclen=h.offsets[h.nvar];
+    if (start<0)
+        error("a binary read error occured");
 
+    /* the key variables, which become the sortlist */
+    nby=length(job->by);
+    if (nby<1 || nby>h.nvar)
+        error("'by' must be different variables of the file");
+    ro.nkeys=nby;
+    ro.endian=stata_endian;
+    ro.types=(int *) R_alloc(nby, sizeof(int));
+    ro.offsets=(int *) R_alloc(nby, sizeof(int));
+    vars=(int *) R_alloc(nby, sizeof(int));
+    headlen=(size_t) start;
+    head=(unsigned char *) R_alloc(headlen, 1);
+    if (fseeko(job->in,0,SEEK_SET)!=0 || fread(head,1,headlen,job->in)!=headlen)
+        error("a binary read error occured");
+    p=head+SortlistOffset(&h);
+    memset(p,0,2*((size_t) h.nvar+1));
+    for(k=0;k<nby;k++){
+        if (isString(job->by))
+            PROTECT(key=ScalarString(STRING_ELT(job->by,k)));
+        else
+            PROTECT(key=ScalarInteger(INTEGER(job->by)[k]));
+        vars[k]=FindVariable(&h,key);
+        UNPROTECT(1);
+        for(i=0;i<k;i++)
+            if (vars[i]==vars[k])
+                error("'by' must be different variables of the file");
+        ro.types[k]=h.types[vars[k]];
+        ro.offsets[k]=h.offsets[vars[k]];
+        /* variable numbers from 1, in the file's byte order */
+        p[2*k]=(stata_endian==LOHI ? (vars[k]+1)>>8 : (vars[k]+1)&255);
+        p[2*k+1]=(stata_endian==LOHI ? (vars[k]+1)&255 : (vars[k]+1)>>8);
+    }
 
-    if (!isValidString(fname = CADR(call)))
-	error("first argument must be a file name\n");
+    /* anything after the data, such as value labels, is copied after it */
+    end=start+(off_t) h.nobs*reclen;
+    if (fseeko(job->in,0,SEEK_END)!=0 || (size=ftello(job->in))<0)
+        error("a binary read error occured");
+    if (size<end)
+        error("unexpected end of file in data section");
+    taillen=(size_t) (size-end);
+    tail=(unsigned char *) R_alloc(taillen+1, 1);
+    if (fseeko(job->in,end,SEEK_SET)!=0 || fread(tail,1,taillen,job->in)!=taillen
+        || fseeko(job->in,start,SEEK_SET)!=0)
+        error("a binary read error occured");
+
+    if (fwrite(head,1,headlen,job->out)!=headlen)
+        error("a binary write error occured");
+
+    if (h.nobs>0 && reclen>0) {
+        /* each record of a run takes its bytes and two pointers */
+        per=job->memory/(reclen+2*sizeof(unsigned char *));
+        if (per<1)
+            error("'memory' is too small for a record");
+        runrecs=(per<(size_t) h.nobs ? (int) per : h.nobs);
+        memsize=(size_t) runrecs*(reclen+2*sizeof(unsigned char *));
+        job->mem=malloc(memsize);
+        if (!job->mem)
+            error("cannot allocate %.0f bytes to sort with", (double) memsize);
+        recs=(const unsigned char **) (job->mem+(size_t) runrecs*reclen);
+        job->nruns=(h.nobs-1)/runrecs+1;
+        /* room for the runs merged from them too: at most half as
+           many at each pass, rounded up, and fewer than 32 passes */
+        job->runs=calloc(2*(size_t) job->nruns+32, sizeof(sortrun));
+        job->runnames=calloc(2*(size_t) job->nruns+32, sizeof(char *));
+        if (!job->runs || !job->runnames)
+            error("cannot allocate memory");
+
+        for(r=0;r<job->nruns;r++){
+            n=(h.nobs-r*runrecs<runrecs ? h.nobs-r*runrecs : runrecs);
+            if (fread(job->mem,reclen,n,job->in)!=(size_t) n)
+                error("a binary read error occured");
+            for(i=0;i<n;i++)
+                recs[i]=job->mem+(size_t) i*reclen;
+            SortRun(recs,recs+runrecs,n,&ro);
+            if (job->nruns==1) {
+                for(i=0;i<n;i++)
+                    if (fwrite(recs[i],1,reclen,job->out)!=(size_t) reclen)
+                        error("a binary write error occured");
+                break;
+            }
+            fp=NewRun(job,r);
+            job->runs[r].left=n;
+            for(i=0;i<n;i++)
+                if (fwrite(recs[i],1,reclen,fp)!=(size_t) reclen)
+                    error("a binary write error occured");
+            EndRun(job,r);
+        }
+        if (job->nruns>1)
+            MergeAll(job,reclen,memsize,&ro);
+    }
+
+    if (taillen>0 && fwrite(tail,1,taillen,job->out)!=taillen)
+        error("a binary write error occured");
+    if (fflush(job->out)!=0)
+        error("a binary write error occured");
+    job->done=1;
+    return R_NilValue;
+}
+
+static void CloseSort(void *data)
+{
+    sortjob *job=data;
+    int r;
+
+    for(r=0;r<job->nruns;r++){
+        if (job->runs && job->runs[r].fp)
+            fclose(job->runs[r].fp);
+        if (job->runnames && job->runnames[r]) {
+            remove(job->runnames[r]);
+            free(job->runnames[r]);
+        }
+    }
+    free(job->runs);
+    free(job->runnames);
+    free(job->mem);
+    fclose(job->in);
+    if (fclose(job->out)!=0)
+        job->done=0;
+    if (!job->done)
+        remove(job->outname);
+}
+
+/**
+   The arguments are the file to sort, the file to write, the
+   variables to sort by (names or numbers from 1), the bytes of memory
+   to use, and the directory for the temporary files.
+**/
+
+SEXP do_sortStata(SEXP call)
+{
+    SEXP infile, outfile, tmpdir;
+    sortjob job;
+    double memory;
 
+    infile=CADR(call);
+    outfile=CADDR(call);
+    if (!isValidString(infile) || !isValidString(outfile))
+	error("file names must be character strings\n");
+    memset(&job, 0, sizeof(sortjob));
+    job.by=CADDDR(call);
+    if (!isString(job.by) && TYPEOF(job.by)!=INTSXP)
+        error("'by' must be variable names or numbers");
+    memory=asReal(CAD4R(call));
+    if (ISNAN(memory) || memory<1)
+        error("'memory' must be a positive number of bytes");
+    job.memory=(memory>(double) ((size_t) -1 / 2) ? (size_t) -1 / 2 : (size_t) memory);
+    tmpdir=CAR(nthcdr(call,5));
+    if (!isValidString(tmpdir))
+        error("'tmpdir' must be a directory name");
+    job.tmpdir=R_ExpandFileName(CHAR(STRING_ELT(tmpdir,0)));
+    job.tmpdir=strcpy(R_alloc(strlen(job.tmpdir)+1, 1),job.tmpdir);
 
-    fp = fopen(R_ExpandFileName(CHAR(STRING_ELT(fname,0))), "wb");
-    if (!fp)
+    job.in=fopen(R_ExpandFileName(CHAR(STRING_ELT(infile,0))), "rb");
+    if (!job.in)
 	error("unable to open file");
- 
-    df=CADDR(call);
-    if (!inherits(df,"data.frame"))
-        error("data to be saved must be in a data frame.");
- 
-    R_SaveStataData(fp,df);
-    fclose(fp);
+    job.outname=BatchPath(outfile,0);
+    job.out=fopen(job.outname, "wb");
+    if (!job.out) {
+        fclose(job.in);
+	error("unable to open file");
+    }
+    return R_ExecWithCleanup(SortFile, &job, CloseSort, &job);
+}
+
+
+/** Joining two files sorted on the same key, in one pass over each:
+    the rows of the right file with the key of a row of the left file
+    are held while that key lasts, so only one key's rows of the
+    right file are in memory at a time **/
+
+typedef struct {
+    int nkeys;
+    int *lkeys, *rkeys;      /* key variables of each file */
+    int nextra, *extra;      /* variables of the right file that are not keys */
+    int reclen;              /* of the output */
+} joinplan;
+
+typedef struct {
+    dtasource src;
+    blockreader *br;
+    const unsigned char *block;
+    int nrec, pos, left;     /* records of block, the next, and those still to read */
+} joinside;
+
+typedef struct {
+    FILE *lfp, *rfp, *out;
+    const char *outname;
+    SEXP by;
+    joinside l, r;
+    unsigned char *group;    /* right records with the current key */
+    size_t groupsize;
+    int done;
+} joinjob;
+
+/* the next record, or NULL at the end */
+
+static const unsigned char *NextRecord(joinside *s, int reclen)
+{
+    if (s->pos==s->nrec) {
+        if (s->left==0)
+            return NULL;
+        s->block=blockreader_next(s->br,&s->nrec);
+        if (!s->block)
+            error("%s", blockreader_error(s->br));
+        s->left-=s->nrec;
+        s->pos=0;
+    }
+    return s->block+(size_t) (s->pos++)*reclen;
+}
+
+/* strings of different widths, as Stata compares them */
+
+static int CompareStringFields(const unsigned char *a, int wa,
+                               const unsigned char *b, int wb)
+{
+    int i,ca,cb;
+
+    for(i=0;;i++){
+        ca=(i<wa ? a[i] : 0);
+        cb=(i<wb ? b[i] : 0);
+        if (ca!=cb)
+            return (ca<cb ? -1 : 1);
+        if (ca==0)
+            return 0;
+    }
+}
+
+static int IsStataString(int type)
+{
+    switch (type) {
+    case STATA_FLOAT:
+    case STATA_DOUBLE:
+    case STATA_INT:
+    case STATA_SHORTINT:
+    case STATA_BYTE:
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+static int CompareJoinKeys(const unsigned char *a, dtaheader *ha,
+                           const unsigned char *b, dtaheader *hb,
+                           joinplan *jp)
+{
+    int k,c,ta,tb;
+    const unsigned char *pa, *pb;
+    double x,y;
+
+    for(k=0;k<jp->nkeys;k++){
+        ta=ha->types[jp->lkeys[k]];
+        tb=hb->types[jp->rkeys[k]];
+        pa=a+ha->offsets[jp->lkeys[k]];
+        pb=b+hb->offsets[jp->rkeys[k]];
+        if (IsStataString(ta)) {
+            c=CompareStringFields(pa,ta-STATA_STRINGOFFSET,pb,tb-STATA_STRINGOFFSET);
+        } else {
+            x=RecordNumber(pa,ta,endian);
+            y=RecordNumber(pb,tb,endian);
+            c=(x<y ? -1 : x>y);
+        }
+        if (c)
+            return c;
+    }
+    return 0;
+}
+
+/* whether the file's sortlist starts with the keys */
+
+static int SortedBy(dtaheader *h, int *keys, int nkeys)
+{
+    int k;
+
+    for(k=0;k<nkeys;k++)
+        if (h->sortlist[k]!=keys[k]+1)
+            return 0;
+    return 1;
+}
+
+static int HasLabelTable(const unsigned char *tail, size_t taillen,
+                         const char *name)
+{
+    size_t pos=0;
+    char aname[9];
+
+    while(NextLabelTable(tail,taillen,&pos,aname))
+        if (!strcmp(aname,name))
+            return 1;
+    return 0;
+}
+
+/* the contents of the value label table of a variable, or NULL */
+
+static const unsigned char *LabelTable(const unsigned char *tail, size_t taillen,
+                                       const char *lblname, size_t *len)
+{
+    size_t pos=0, n;
+    char aname[9], lname[9];
+
+    memcpy(lname,lblname,9);
+    lname[8]=0;
+    if (!lname[0])
+        return NULL;
+    while((n=NextLabelTable(tail,taillen,&pos,aname)))
+        if (!strcmp(aname,lname)) {
+            *len=n-(4+9+3);
+            return tail+pos-*len;
+        }
+    return NULL;
+}
+
+/**
+   Keys are compared by the values stored, so the codes of a labelled
+   key must be labelled the same way in both files.
+**/
+
+static void CheckKeyLabels(dtaheader *lh, const unsigned char *ltail, size_t ltaillen,
+                           dtaheader *rh, const unsigned char *rtail, size_t rtaillen,
+                           joinplan *jp)
+{
+    int k;
+    size_t llen=0, rlen=0;
+    const unsigned char *lt, *rt;
+
+    for(k=0;k<jp->nkeys;k++){
+        lt=LabelTable(ltail,ltaillen,lh->lblnames[jp->lkeys[k]],&llen);
+        rt=LabelTable(rtail,rtaillen,rh->lblnames[jp->rkeys[k]],&rlen);
+        if (!lt && !rt)
+            continue;
+        if (!lt || !rt || llen!=rlen || memcmp(lt,rt,llen))
+            error("key '%s' has different value labels in the two files",
+                  lh->names[jp->lkeys[k]]);
+    }
+}
+
+/**
+   The name each value label table of the right file is written under,
+   or "" for one not written: tables no joined variable uses, and those
+   the left file has the same.  A table whose name the left file uses
+   for different labels is renamed, and so are its variables' labels.
+**/
+
+static char (*RightLabelNames(const unsigned char *ltail, size_t ltaillen,
+                              const unsigned char *rtail, size_t rtaillen,
+                              dtaheader *rh, joinplan *jp))[9]
+{
+    size_t pos, n, llen=0;
+    const unsigned char *lt;
+    char (*lnames)[9], aname[9], bname[9], suffix[12];
+    int i,j,k,t,ntab,used;
+
+    pos=0;
+    for(ntab=0;NextLabelTable(rtail,rtaillen,&pos,aname);ntab++)
+        ;
+    lnames=(char (*)[9]) R_alloc(ntab+1, 9);
+    pos=0;
+    for(t=0;(n=NextLabelTable(rtail,rtaillen,&pos,aname));t++){
+        memset(lnames[t],0,9);
+        used=0;
+        for(j=0;j<jp->nextra;j++)
+            if (!strncmp(rh->lblnames[jp->extra[j]],aname,9))
+                used=1;
+        if (!used)
+            continue;
+        lt=LabelTable(ltail,ltaillen,aname,&llen);
+        if (!lt) {
+            memcpy(lnames[t],aname,9);
+            continue;
+        }
+        if (llen==n-(4+9+3) && !memcmp(lt,rtail+pos-llen,llen))
+            continue;
+        /* a name that neither file nor an earlier table uses */
+        for(k=1;;k++){
+            i=sprintf(suffix,"%d",k);
+            memset(lnames[t],0,9);
+            strncpy(lnames[t],aname,8-i);
+            strcpy(lnames[t]+strlen(lnames[t]),suffix);
+            if (HasLabelTable(ltail,ltaillen,lnames[t])
+                || HasLabelTable(rtail,rtaillen,lnames[t]))
+                continue;
+            for(i=0;i<t;i++)
+                if (!strcmp(lnames[i],lnames[t]))
+                    break;
+            if (i==t)
+                break;
+        }
+        for(j=0;j<jp->nextra;j++){
+            memcpy(bname,rh->lblnames[jp->extra[j]],9);
+            bname[8]=0;
+            if (!strcmp(bname,aname))
+                memcpy(rh->lblnames[jp->extra[j]],lnames[t],9);
+        }
+    }
+    return lnames;
+}
+
+static void WriteJoinHeader(outbuffer *ob, dtaheader *l, dtaheader *r,
+                            joinplan *jp)
+{
+    int i,j,nvar=l->nvar+jp->nextra;
+    char timestamp[18];
+
+    OutByteBinary((char) 108,ob);            /* release */
+    OutByteBinary((char) endian,ob);
+    OutByteBinary(1,ob);            /* filetype */
+    OutByteBinary(0,ob);            /* padding */
+    OutShortIntBinary(nvar,ob);
+    OutIntegerBinary(0,ob,1);       /* number of cases, when they are known */
+    OutStringBinary(l->datalabel,ob,81);
+    memset(timestamp,0,18);
+    OutStringBinary(timestamp,ob,18);
+
+    for(i=0;i<l->nvar;i++)
+        OutByteBinary((unsigned char) l->types[i],ob);
+    for(j=0;j<jp->nextra;j++)
+        OutByteBinary((unsigned char) r->types[jp->extra[j]],ob);
+    for(i=0;i<l->nvar;i++)
+        OutStringBinary(l->names[i],ob,9);
+    for(j=0;j<jp->nextra;j++)
+        OutStringBinary(r->names[jp->extra[j]],ob,9);
+
+    /* sorted by the keys, where they are in the left file */
+    for(i=0;i<jp->nkeys;i++)
+        OutShortIntBinary(jp->lkeys[i]+1,ob);
+    OutZeroBinary(ob,2*(nvar+1-jp->nkeys));
+
+    for(i=0;i<l->nvar;i++)
+        OutStringBinary(l->formats[i],ob,12);
+    for(j=0;j<jp->nextra;j++)
+        OutStringBinary(r->formats[jp->extra[j]],ob,12);
+    for(i=0;i<l->nvar;i++)
+        OutStringBinary(l->lblnames[i],ob,9);
+    for(j=0;j<jp->nextra;j++)
+        OutStringBinary(r->lblnames[jp->extra[j]],ob,9);
+    for(i=0;i<l->nvar;i++)
+        OutStringBinary(l->varlabels[i],ob,81);
+    for(j=0;j<jp->nextra;j++)
+        OutStringBinary(r->varlabels[jp->extra[j]],ob,81);
+
+    OutZeroBinary(ob,3);            /* characteristics */
+}
+
+/* the keys in each file, by name or from the left file's sortlist */
+
+static void PlanJoin(joinjob *job, dtaheader *l, dtaheader *r, joinplan *jp)
+{
+    int i,j,k;
+    char aname[10];
+    SEXP key;
+
+    if (isNull(job->by)) {
+        for(k=0;k<l->nvar && l->sortlist[k];k++)
+            ;
+        if (k==0)
+            error("the left file is not sorted, so 'by' must be given");
+        jp->nkeys=k;
+    } else
+        jp->nkeys=length(job->by);
+    if (jp->nkeys<1 || jp->nkeys>l->nvar || jp->nkeys>r->nvar)
+        error("'by' must be different variables of both files");
+    jp->lkeys=(int *) R_alloc(jp->nkeys, sizeof(int));
+    jp->rkeys=(int *) R_alloc(jp->nkeys, sizeof(int));
+    for(k=0;k<jp->nkeys;k++){
+        if (isNull(job->by)) {
+            jp->lkeys[k]=l->sortlist[k]-1;
+            if (jp->lkeys[k]<0 || jp->lkeys[k]>=l->nvar)
+                error("the left file has a bad sortlist");
+        } else {
+            PROTECT(key=ScalarString(STRING_ELT(job->by,k)));
+            jp->lkeys[k]=FindVariable(l,key);
+            UNPROTECT(1);
+        }
+        memcpy(aname,l->names[jp->lkeys[k]],9);
+        aname[9]=0;
+        PROTECT(key=mkString(aname));
+        jp->rkeys[k]=FindVariable(r,key);
+        UNPROTECT(1);
+        for(i=0;i<k;i++)
+            if (jp->lkeys[i]==jp->lkeys[k])
+                error("'by' must be different variables of both files");
+        if (IsStataString(l->types[jp->lkeys[k]])!=IsStataString(r->types[jp->rkeys[k]]))
+            error("'%s' is a string in one file and a number in the other", aname);
+    }
+    if (!SortedBy(l,jp->lkeys,jp->nkeys))
+        error("the left file is not sorted by 'by'; see sort.dta()");
+    if (!SortedBy(r,jp->rkeys,jp->nkeys))
+        error("the right file is not sorted by 'by'; see sort.dta()");
+
+    /* the other variables of the right file follow those of the left */
+    jp->extra=(int *) R_alloc(r->nvar, sizeof(int));
+    jp->nextra=0;
+    jp->reclen=l->offsets[l->nvar];
+    for(j=0;j<r->nvar;j++){
+        for(k=0;k<jp->nkeys;k++)
+            if (jp->rkeys[k]==j)
+                break;
+        if (k<jp->nkeys)
+            continue;
+        for(i=0;i<l->nvar;i++)
+            if (!strncmp(l->names[i],r->names[j],9))
+                error("both files have a variable '%s'", r->names[j]);
+        jp->extra[jp->nextra++]=j;
+        jp->reclen+=StataTypeWidth(r->types[j]);
+    }
+    if (l->nvar+jp->nextra>32767)
+        error("too many variables for a .dta file");
+}
+
+static SEXP JoinFiles(void *data)
+{
+    joinjob *job=data;
+    dtaheader lh, rh;
+    joinplan jp;
+    datasink sink;
+    outbuffer ob;
+    const unsigned char *lrec, *rrec;
+    unsigned char *ltail, *rtail, *p;
+    size_t ltaillen, rtaillen, pos, n, ngroup, g;
+    off_t lstart, rstart;
+    int j, lreclen, rreclen, w;
+    double nobs=0;
+    int total;
+    char aname[9], (*rnames)[9];
+
+    source_file(&job->l.src,job->lfp);
+    ReadHeader(&job->l.src,&lh);
+    if (lh.swapends)
+        error("can only join files written in this machine's byte order");
+    source_file(&job->r.src,job->rfp);
+    ReadHeader(&job->r.src,&rh);
+    if (rh.swapends)
+        error("can only join files written in this machine's byte order");
+    lstart=ftello(job->lfp);
+    rstart=ftello(job->rfp);
+    if (lstart<0 || rstart<0)
+        error("a binary read error occured");
+    lreclen=lh.offsets[lh.nvar];
+    rreclen=rh.offsets[rh.nvar];
+    PlanJoin(job,&lh,&rh,&jp);
+
+    /* value labels of v5 files are not copied */
+    ltail=ReadTail(job->lfp,&lh,lstart,&ltaillen);
+    rtail=ReadTail(job->rfp,&rh,rstart,&rtaillen);
+    if (lh.version5)
+        for(j=0;j<lh.nvar;j++)
+            lh.lblnames[j][0]=0;
+    if (rh.version5)
+        for(j=0;j<rh.nvar;j++)
+            rh.lblnames[j][0]=0;
+    if (!lh.version5 && !rh.version5)
+        CheckKeyLabels(&lh,ltail,ltaillen,&rh,rtail,rtaillen,&jp);
+    rnames=RightLabelNames(ltail,ltaillen,rtail,rtaillen,&rh,&jp);
+
+    sink_file(&sink,job->out);
+    ob.sink=&sink;
+    ob.len=0;
+    ob.size=(jp.reclen>OUTBUFSIZE ? jp.reclen : OUTBUFSIZE);
+    ob.buf=(unsigned char *) R_alloc(ob.size, 1);
+    WriteJoinHeader(&ob,&lh,&rh,&jp);
+
+    job->l.br=blockreader_open(&job->l.src,lreclen,lh.nobs,0);
+    job->r.br=blockreader_open(&job->r.src,rreclen,rh.nobs,0);
+    if (!job->l.br || !job->r.br)
+        error("cannot allocate buffer for data");
+    job->l.left=lh.nobs;
+    job->r.left=rh.nobs;
+
+    ngroup=0;
+    rrec=NextRecord(&job->r,rreclen);
+    while((lrec=NextRecord(&job->l,lreclen))){
+        if (ngroup==0 || CompareJoinKeys(lrec,&lh,job->group,&rh,&jp)!=0) {
+            /* a new key: the rows of the right file that have it */
+            ngroup=0;
+            while(rrec && CompareJoinKeys(lrec,&lh,rrec,&rh,&jp)>0)
+                rrec=NextRecord(&job->r,rreclen);
+            while(rrec && CompareJoinKeys(lrec,&lh,rrec,&rh,&jp)==0){
+                if ((ngroup+1)*rreclen>job->groupsize) {
+                    n=(job->groupsize ? 2*job->groupsize : 64*(size_t) rreclen);
+                    p=realloc(job->group,n);
+                    if (!p)
+                        error("cannot allocate memory for the rows of one key");
+                    job->group=p;
+                    job->groupsize=n;
+                }
+                memcpy(job->group+ngroup*rreclen,rrec,rreclen);
+                ngroup++;
+                rrec=NextRecord(&job->r,rreclen);
+            }
+        }
+        for(g=0;g<ngroup;g++){
+            p=OutReserve(&ob,jp.reclen);
+            memcpy(p,lrec,lreclen);
+            p+=lreclen;
+            for(j=0;j<jp.nextra;j++){
+                w=StataTypeWidth(rh.types[jp.extra[j]]);
+                memcpy(p,job->group+g*rreclen+rh.offsets[jp.extra[j]],w);
+                p+=w;
+            }
+            ob.len+=jp.reclen;
+        }
+        nobs+=ngroup;
+        if (nobs>2147483647)
+            error("too many cases for a .dta file");
+    }
+    OutFlush(&ob);
+
+    if (ltaillen>0 && fwrite(ltail,1,ltaillen,job->out)!=ltaillen)
+        error("a binary write error occured");
+    pos=0;
+    for(j=0;(n=NextLabelTable(rtail,rtaillen,&pos,aname));j++){
+        p=rtail+pos-n;
+        if (rnames[j][0]
+            && (fwrite(p,1,4,job->out)!=4 || fwrite(rnames[j],1,9,job->out)!=9
+                || fwrite(p+4+9,1,n-4-9,job->out)!=n-4-9))
+            error("a binary write error occured");
+    }
+
+    total=(int) nobs;
+    if (fflush(job->out)!=0 || fseeko(job->out,NOBS_OFFSET,SEEK_SET)!=0
+        || fwrite(&total,sizeof(int),1,job->out)!=1 || fflush(job->out)!=0)
+        error("a binary write error occured");
+    job->done=1;
     return R_NilValue;
 }
+
+static void CloseJoin(void *data)
+{
+    joinjob *job=data;
+
+    blockreader_close(job->l.br);
+    blockreader_close(job->r.br);
+    free(job->group);
+    fclose(job->lfp);
+    fclose(job->rfp);
+    if (fclose(job->out)!=0)
+        job->done=0;
+    if (!job->done)
+        remove(job->outname);
+}
+
+/**
+   The arguments are the left and right files, the names of the key
+   variables or NULL for those the left file is sorted by, and the
+   file to write.  Rows of the left file are joined to every row of
+   the right file with the same key, and rows without a match in the
+   other file are dropped.
+**/
+
+SEXP do_joinStata(SEXP call)
+{
+    SEXP left, right, outfile;
+    joinjob job;
+
+    left=CADR(call);
+    right=CADDR(call);
+    outfile=CAD4R(call);
+    if (!isValidString(left) || !isValidString(right) || !isValidString(outfile))
+	error("file names must be character strings\n");
+    memset(&job, 0, sizeof(joinjob));
+    job.by=CADDDR(call);
+    if (!isNull(job.by) && !isString(job.by))
+        error("'by' must be variable names");
+
+    job.lfp=fopen(R_ExpandFileName(CHAR(STRING_ELT(left,0))), "rb");
+    if (!job.lfp)
+	error("unable to open file");
+    job.rfp=fopen(R_ExpandFileName(CHAR(STRING_ELT(right,0))), "rb");
+    if (!job.rfp) {
+        fclose(job.lfp);
+	error("unable to open file");
+    }
+    job.outname=BatchPath(outfile,0);
+    job.out=fopen(job.outname, "wb");
+    if (!job.out) {
+        fclose(job.lfp);
+        fclose(job.rfp);
+	error("unable to open file");
+    }
+    return R_ExecWithCleanup(JoinFiles, &job, CloseJoin, &job);
+}
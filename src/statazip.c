@@ -0,0 +1,545 @@
+/**
+  Compressed .dta files.
+
+  (c) 2026 the stataread contributors.
+
+  gzip is always supported; zstd needs a build with
+  libzstd, ie PKG_CPPFLAGS=-DHAVE_ZSTD and PKG_LIBS=-lzstd added
+  to src/Makevars.
+
+  A compressed file is decompressed by its own thread into a pipe,
+  and the read end of the pipe is handed to the ordinary reader as
+  a FILE *, so decompression and decoding overlap and nothing is
+  written to disk.
+
+  Output goes the other way: the writer writes into a pipe, and a
+  thread reads it in blocks and compresses several blocks at a time
+  on worker threads, pigz-style.  Each block becomes a complete gzip
+  member or zstd frame; concatenated, these are a valid file for
+  gunzip, zstd and the reader here.
+
+  No R API calls are made here, so the threads are safe.
+**/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+# include <zstd.h>
+#endif
+#include "stataio.h"
+
+#ifdef STATA_THREADS
+# include <pthread.h>
+# include <signal.h>
+# include <unistd.h>
+#endif
+
+#define ZIP_CHUNK (1024*1024)
+/* uncompressed size of each independently compressed block */
+#define ZIP_BLOCK (1024*1024)
+
+static const unsigned char gzip_magic[2] = {0x1f, 0x8b};
+static const unsigned char zstd_magic[4] = {0x28, 0xb5, 0x2f, 0xfd};
+
+/**
+   Looks at the first bytes of fp and leaves it positioned at the start.
+   Returns ZIP_NONE for an uncompressed (or unrecognised) file, and
+   for one that cannot seek, such as a pipe, whose bytes would be lost.
+**/
+
+int zip_detect(FILE *fp)
+{
+    unsigned char magic[4];
+    size_t n;
+    off_t start;
+
+    start = ftello(fp);
+    if (start < 0 || fseeko(fp, start, SEEK_SET) != 0)
+	return ZIP_NONE;
+    n = fread(magic, 1, 4, fp);
+    if (fseeko(fp, start, SEEK_SET) != 0)
+	return ZIP_NONE;
+    if (n >= 2 && memcmp(magic, gzip_magic, 2) == 0)
+	return ZIP_GZIP;
+    if (n == 4 && memcmp(magic, zstd_magic, 4) == 0)
+	return ZIP_ZSTD;
+    return ZIP_NONE;
+}
+
+/* the compression to write a file with, from the end of its name */
+
+int zip_suffix(const char *name)
+{
+    size_t n = strlen(name);
+
+    if (n >= 3 && strcmp(name + n - 3, ".gz") == 0)
+	return ZIP_GZIP;
+    if (n >= 4 && strcmp(name + n - 4, ".zst") == 0)
+	return ZIP_ZSTD;
+    return ZIP_NONE;
+}
+
+
+#ifdef STATA_THREADS
+
+struct unzipper {
+    int type;
+    int infd;          /* our own copy of the compressed file */
+    int outfd;         /* write end of the pipe */
+    FILE *out;         /* read end, for the reader */
+    pthread_t thread;
+    const char *err;
+};
+
+static const char *corrupt = "compressed file is corrupt or truncated";
+
+/* 0 when the reader has gone away, which ends decompression quietly */
+
+static int write_all(int fd, const unsigned char *buf, size_t len)
+{
+    ssize_t put;
+
+    while (len > 0) {
+	put = write(fd, buf, len);
+	if (put < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return 0;
+	}
+	buf += put;
+	len -= put;
+    }
+    return 1;
+}
+
+static void gunzip_stream(struct unzipper *uz)
+{
+    gzFile gz;
+    unsigned char *buf;
+    int n;
+
+    buf = malloc(ZIP_CHUNK);
+    gz = gzdopen(uz->infd, "rb");
+    if (!buf || !gz) {
+	uz->err = "cannot start decompression";
+	if (gz)
+	    gzclose(gz);
+	else
+	    close(uz->infd);
+	free(buf);
+	return;
+    }
+    uz->infd = -1;      /* owned by gz now */
+    gzbuffer(gz, ZIP_CHUNK);
+    while ((n = gzread(gz, buf, ZIP_CHUNK)) > 0)
+	if (!write_all(uz->outfd, buf, n))
+	    break;
+    if (n < 0)
+	uz->err = corrupt;
+    gzclose(gz);
+    free(buf);
+}
+
+#ifdef HAVE_ZSTD
+static void unzstd_stream(struct unzipper *uz)
+{
+    ZSTD_DStream *zs;
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    unsigned char *inbuf, *outbuf;
+    size_t inlen, outlen, ret = 0;
+    ssize_t got;
+
+    inlen = ZSTD_DStreamInSize();
+    outlen = ZSTD_DStreamOutSize();
+    inbuf = malloc(inlen);
+    outbuf = malloc(outlen);
+    zs = ZSTD_createDStream();
+    if (!inbuf || !outbuf || !zs || ZSTD_isError(ZSTD_initDStream(zs))) {
+	uz->err = "cannot start decompression";
+	goto done;
+    }
+    while ((got = read(uz->infd, inbuf, inlen)) != 0) {
+	if (got < 0) {
+	    if (errno == EINTR)
+		continue;
+	    uz->err = "a binary read error occured";
+	    goto done;
+	}
+	in.src = inbuf;
+	in.size = got;
+	in.pos = 0;
+	while (in.pos < in.size) {
+	    out.dst = outbuf;
+	    out.size = outlen;
+	    out.pos = 0;
+	    ret = ZSTD_decompressStream(zs, &out, &in);
+	    if (ZSTD_isError(ret)) {
+		uz->err = corrupt;
+		goto done;
+	    }
+	    if (!write_all(uz->outfd, outbuf, out.pos))
+		goto done;
+	}
+    }
+    if (ret != 0)      /* input ended inside a frame */
+	uz->err = corrupt;
+done:
+    ZSTD_freeDStream(zs);
+    free(inbuf);
+    free(outbuf);
+    close(uz->infd);
+    uz->infd = -1;
+}
+#endif
+
+static void *unzip_thread(void *arg)
+{
+    struct unzipper *uz = arg;
+
+#ifdef HAVE_ZSTD
+    if (uz->type == ZIP_ZSTD)
+	unzstd_stream(uz);
+    else
+#endif
+	gunzip_stream(uz);
+    close(uz->outfd);
+    uz->outfd = -1;
+    return NULL;
+}
+
+/**
+   Starts decompressing fp, which zip_detect() found to be of the
+   given type.  fp itself is not touched again and is still the
+   caller's to close.  Returns NULL with *err set on failure.
+**/
+
+unzipper *unzip_open(FILE *fp, int type, const char **err)
+{
+    struct unzipper *uz;
+    int fds[2];
+    sigset_t block, old;
+
+#ifndef HAVE_ZSTD
+    if (type == ZIP_ZSTD) {
+	*err = "zstd-compressed files need stataread built with libzstd";
+	return NULL;
+    }
+#endif
+    *err = "cannot start decompression";
+    uz = calloc(1, sizeof(struct unzipper));
+    if (!uz)
+	return NULL;
+    uz->type = type;
+    uz->infd = dup(fileno(fp));
+    if (uz->infd < 0) {
+	free(uz);
+	return NULL;
+    }
+    lseek(uz->infd, 0, SEEK_SET);
+    if (pipe(fds) != 0) {
+	close(uz->infd);
+	free(uz);
+	return NULL;
+    }
+    uz->out = fdopen(fds[0], "rb");
+    uz->outfd = fds[1];
+    if (!uz->out) {
+	close(fds[0]);
+	close(fds[1]);
+	close(uz->infd);
+	free(uz);
+	return NULL;
+    }
+    /* a reader that stops early closes the pipe: the thread should
+       see EPIPE rather than have SIGPIPE delivered to the process */
+    sigemptyset(&block);
+    sigaddset(&block, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    if (pthread_create(&uz->thread, NULL, unzip_thread, uz) != 0) {
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	fclose(uz->out);
+	close(uz->outfd);
+	close(uz->infd);
+	free(uz);
+	return NULL;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    *err = NULL;
+    return uz;
+}
+
+FILE *unzip_file(unzipper *uz)
+{
+    return uz->out;
+}
+
+/* Stops decompression if it is still running; returns any error. */
+
+const char *unzip_close(unzipper *uz)
+{
+    const char *err;
+
+    fclose(uz->out);
+    pthread_join(uz->thread, NULL);
+    err = uz->err;
+    free(uz);
+    return err;
+}
+
+
+/** Compression **/
+
+struct zipper {
+    int type;
+    int threads;
+    int infd;          /* read end of the pipe */
+    FILE *in;          /* write end, for the writer */
+    int outfd;         /* our copy of the output file */
+    pthread_t thread;
+    const char *err;
+    unsigned char **raw, **packed;   /* a block for each thread */
+    size_t *rawlen, *packedlen;
+    size_t bound;      /* room for a compressed block */
+};
+
+/* 0 at end of file, -1 on error */
+
+static ssize_t read_full(int fd, unsigned char *buf, size_t len)
+{
+    ssize_t got;
+    size_t done = 0;
+
+    while (done < len) {
+	got = read(fd, buf + done, len - done);
+	if (got < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if (got == 0)
+	    break;
+	done += got;
+    }
+    return done;
+}
+
+static void pack_block(void *arg, int task, int thread)
+{
+    struct zipper *zp = arg;
+    z_stream zs;
+
+    zp->packedlen[task] = 0;
+#ifdef HAVE_ZSTD
+    if (zp->type == ZIP_ZSTD) {
+	size_t n = ZSTD_compress(zp->packed[task], zp->bound, zp->raw[task],
+				 zp->rawlen[task], 3);  /* zstd's default level */
+	if (!ZSTD_isError(n))
+	    zp->packedlen[task] = n;
+	return;
+    }
+#endif
+    memset(&zs, 0, sizeof(z_stream));
+    /* 16+MAX_WBITS: a gzip header and trailer on each block */
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS,
+		     8, Z_DEFAULT_STRATEGY) != Z_OK)
+	return;
+    zs.next_in = zp->raw[task];
+    zs.avail_in = zp->rawlen[task];
+    zs.next_out = zp->packed[task];
+    zs.avail_out = zp->bound;
+    if (deflate(&zs, Z_FINISH) == Z_STREAM_END)
+	zp->packedlen[task] = zs.total_out;
+    deflateEnd(&zs);
+}
+
+static void *zip_thread(void *arg)
+{
+    struct zipper *zp = arg;
+    int i, nblocks, eof = 0;
+    ssize_t got;
+
+    while (!eof) {
+	for (nblocks = 0; nblocks < zp->threads; nblocks++) {
+	    got = read_full(zp->infd, zp->raw[nblocks], ZIP_BLOCK);
+	    if (got < 0 && !zp->err)
+		zp->err = "a binary read error occured";
+	    if (got <= 0) {
+		eof = 1;
+		break;
+	    }
+	    zp->rawlen[nblocks] = got;
+	}
+	/* after an error the pipe is still drained, so the writer
+	   never blocks, but nothing more is compressed */
+	if (zp->err || nblocks == 0)
+	    continue;
+	parallel_for(zp->threads, nblocks, pack_block, zp);
+	for (i = 0; i < nblocks && !zp->err; i++) {
+	    if (zp->packedlen[i] == 0)
+		zp->err = "compression failed";
+	    else if (!write_all(zp->outfd, zp->packed[i], zp->packedlen[i]))
+		zp->err = "a binary write error occured";
+	}
+    }
+    close(zp->outfd);
+    zp->outfd = -1;
+    return NULL;
+}
+
+static void zip_free(struct zipper *zp)
+{
+    int i;
+
+    for (i = 0; i < zp->threads; i++) {
+	if (zp->raw)
+	    free(zp->raw[i]);
+	if (zp->packed)
+	    free(zp->packed[i]);
+    }
+    free(zp->raw);
+    free(zp->packed);
+    free(zp->rawlen);
+    free(zp->packedlen);
+    free(zp);
+}
+
+/**
+   Starts compressing into fp, which should be empty; the caller then
+   writes to zip_file() instead, and closes fp after zip_close().
+   Returns NULL with *err set on failure.
+**/
+
+zipper *zip_open(FILE *fp, int type, int threads, const char **err)
+{
+    struct zipper *zp;
+    int i, fds[2];
+    sigset_t block, old;
+
+#ifndef HAVE_ZSTD
+    if (type == ZIP_ZSTD) {
+	*err = "zstd-compressed files need stataread built with libzstd";
+	return NULL;
+    }
+#endif
+    *err = "cannot start compression";
+    zp = calloc(1, sizeof(struct zipper));
+    if (!zp)
+	return NULL;
+    zp->type = type;
+    zp->threads = threads > 0 ? threads : 1;
+#ifdef HAVE_ZSTD
+    if (type == ZIP_ZSTD)
+	zp->bound = ZSTD_compressBound(ZIP_BLOCK);
+    else
+#endif
+	zp->bound = compressBound(ZIP_BLOCK) + 32;   /* and the gzip wrapper */
+    zp->raw = calloc(zp->threads, sizeof(unsigned char *));
+    zp->packed = calloc(zp->threads, sizeof(unsigned char *));
+    zp->rawlen = calloc(zp->threads, sizeof(size_t));
+    zp->packedlen = calloc(zp->threads, sizeof(size_t));
+    if (!zp->raw || !zp->packed || !zp->rawlen || !zp->packedlen) {
+	zip_free(zp);
+	return NULL;
+    }
+    for (i = 0; i < zp->threads; i++) {
+	zp->raw[i] = malloc(ZIP_BLOCK);
+	zp->packed[i] = malloc(zp->bound);
+	if (!zp->raw[i] || !zp->packed[i]) {
+	    zip_free(zp);
+	    return NULL;
+	}
+    }
+    fflush(fp);
+    zp->outfd = dup(fileno(fp));
+    if (zp->outfd < 0) {
+	zip_free(zp);
+	return NULL;
+    }
+    if (pipe(fds) != 0) {
+	close(zp->outfd);
+	zip_free(zp);
+	return NULL;
+    }
+    zp->infd = fds[0];
+    zp->in = fdopen(fds[1], "wb");
+    if (!zp->in) {
+	close(fds[0]);
+	close(fds[1]);
+	close(zp->outfd);
+	zip_free(zp);
+	return NULL;
+    }
+    sigemptyset(&block);
+    sigaddset(&block, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    if (pthread_create(&zp->thread, NULL, zip_thread, zp) != 0) {
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	fclose(zp->in);
+	close(zp->infd);
+	close(zp->outfd);
+	zip_free(zp);
+	return NULL;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    *err = NULL;
+    return zp;
+}
+
+FILE *zip_file(zipper *zp)
+{
+    return zp->in;
+}
+
+/* Finishes the compressed file; returns any error. */
+
+const char *zip_close(zipper *zp)
+{
+    const char *err;
+
+    if (fclose(zp->in) != 0 && !zp->err)
+	zp->err = "a binary write error occured";
+    pthread_join(zp->thread, NULL);
+    close(zp->infd);
+    err = zp->err;
+    zip_free(zp);
+    return err;
+}
+
+#else
+
+unzipper *unzip_open(FILE *fp, int type, const char **err)
+{
+    *err = "compressed .dta files are not supported on this platform";
+    return NULL;
+}
+
+FILE *unzip_file(unzipper *uz)
+{
+    return NULL;
+}
+
+const char *unzip_close(unzipper *uz)
+{
+    return NULL;
+}
+
+zipper *zip_open(FILE *fp, int type, int threads, const char **err)
+{
+    *err = "compressed .dta files are not supported on this platform";
+    return NULL;
+}
+
+FILE *zip_file(zipper *zp)
+{
+    return NULL;
+}
+
+const char *zip_close(zipper *zp)
+{
+    return NULL;
+}
+
+#endif